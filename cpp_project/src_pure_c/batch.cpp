@@ -0,0 +1,116 @@
+/*
+This file implements Batch.
+*/
+#include "batch.h"
+
+unsigned long long BatchResult::value() const
+{
+    unsigned long long v = 0;
+    for(int i = 0; i < (int) data.size() && i < 8; ++i)
+        v |= (unsigned long long) data[i] << (8 * i);
+    return v;
+}
+
+
+Batch::Batch(Transport *transport, int user1_dr_length, const TransportOptions &options)
+    : m_scans(transport, user1_dr_length, options)
+{
+}
+
+Batch::~Batch()
+{
+    fail_pending();
+}
+
+// Operation that could not be queued, or whose batch was never sent
+static std::future<BatchResult> failed_result()
+{
+    std::promise<BatchResult> result;
+    result.set_value(BatchResult());
+    return result.get_future();
+}
+
+std::future<BatchResult> Batch::queue(int index, int nbits)
+{
+    if(index < 0)
+        return failed_result();
+    m_operations.push_back(Operation());
+    Operation &op = m_operations.back();
+    op.index = index;
+    op.nbits = nbits;
+    return op.result.get_future();
+}
+
+std::future<BatchResult> Batch::write(const VjtagTarget &instance, unsigned long long command, const BitSpan &data)
+{
+    return queue(m_scans.add_scan(instance, command, data, false), 0);
+}
+
+std::future<BatchResult> Batch::write(const VjtagTarget &instance, const BitSpan &command, const BitSpan &data)
+{
+    return queue(m_scans.add_scan(instance, command, data, false), 0);
+}
+
+std::future<BatchResult> Batch::read(const VjtagTarget &instance, unsigned long long command, int nbits)
+{
+    if(nbits < 0)
+        return failed_result();
+    if((int) m_zeros.size() < (nbits + 7) / 8)
+        m_zeros.resize((nbits + 7) / 8, 0);
+    return queue(m_scans.add_scan(instance, command, BitSpan(m_zeros.data(), nbits), true), nbits);
+}
+
+std::future<BatchResult> Batch::read(const VjtagTarget &instance, const BitSpan &command, int nbits)
+{
+    if(nbits < 0)
+        return failed_result();
+    if((int) m_zeros.size() < (nbits + 7) / 8)
+        m_zeros.resize((nbits + 7) / 8, 0);
+    return queue(m_scans.add_scan(instance, command, BitSpan(m_zeros.data(), nbits), true), nbits);
+}
+
+std::future<BatchResult> Batch::exchange(const VjtagTarget &instance, unsigned long long command,
+                                         const BitSpan &data)
+{
+    return queue(m_scans.add_scan(instance, command, data, true), data.length);
+}
+
+std::future<BatchResult> Batch::exchange(const VjtagTarget &instance, const BitSpan &command, const BitSpan &data)
+{
+    return queue(m_scans.add_scan(instance, command, data, true), data.length);
+}
+
+void Batch::fail_pending()
+{
+    for(size_t i = 0; i < m_operations.size(); ++i)
+        m_operations[i].result.set_value(BatchResult());
+    m_operations.clear();
+    m_scans.clear();
+}
+
+bool Batch::submit()
+{
+    if(m_operations.empty())
+        return true;
+    if(!m_scans.execute()){
+        fail_pending();
+        return false;
+    }
+
+    // Scatter the TDO bytes of the round trip into the results
+    for(size_t i = 0; i < m_operations.size(); ++i){
+        Operation &op = m_operations[i];
+        BatchResult result;
+        result.ok = true;
+        if(op.nbits > 0){
+            result.length = op.nbits;
+            result.data.resize((op.nbits + 7) / 8);
+            BitSpan bits = result.bits();
+            result.ok = m_scans.tdo(op.index, bits);
+        }
+        op.result.set_value(std::move(result));
+    }
+    m_operations.clear();
+    m_scans.clear();
+    return true;
+}
@@ -0,0 +1,90 @@
+#ifndef JTAG_BATCH_H
+#define JTAG_BATCH_H
+/*
+Declares Batch, the transaction API on top of VjtagBatch: register-style write/read/exchange calls on VJTAG instances
+that complete together in one USB round trip.
+
+Every call queues one USER0 DR scan of the instance with the command in its VIR and returns a future of its result.
+submit() compiles the queued scans into one encoded buffer with one expected TDO byte count (through VjtagBatch, which
+also orders them to skip VIR loads), writes it, reads the TDO bytes back, and fulfils every future with the bits of its
+own scan. A thousand small register reads thus cost one round trip instead of a thousand.
+
+The futures are ready once submit() returns. A call with an invalid instance or command returns a future that is
+already ready with ok == false. The futures of a batch that is destroyed without submit() get ok == false as well.
+
+Usage:
+    Batch batch(transport, hub.user1_dr_length());
+    VjtagTarget vjtag = hub.target(*node);
+    batch.write(vjtag, 0b01, leds);
+    std::future<BatchResult> sw = batch.read(vjtag, 0b10, 8);
+    batch.submit();
+    BatchResult r = sw.get();
+    if(r.ok)
+        printf("%02llX\n", r.value());
+*/
+#include <future>
+#include <vector>
+#include "ftd2xx.h"
+#include "bit_span.h"
+#include "transport.h"
+#include "ir_dr_util.h"
+#include "vjtag_batch.h"
+
+struct BatchResult {
+    BatchResult() : ok(false), length(0) {}
+
+    bool ok;
+    int length;                 // the number of TDO bits, 0 for write()
+    std::vector<BYTE> data;     // packed TDO bits, see bit_span.h
+
+    BitSpan bits() { return BitSpan(data.data(), length); }
+    unsigned long long value() const;  // the first 64 bits
+};
+
+class Batch {
+public:
+    // The transport is not owned and must outlive the batch
+    Batch(Transport *transport, int user1_dr_length, const TransportOptions &options = TransportOptions());
+    ~Batch();
+
+    // Shift `data` into the DR of the instance
+    std::future<BatchResult> write(const VjtagTarget &instance, unsigned long long command, const BitSpan &data);
+    std::future<BatchResult> write(const VjtagTarget &instance, const BitSpan &command, const BitSpan &data);
+    // Shift `nbits` 0's into the DR and return what it shifts out
+    std::future<BatchResult> read(const VjtagTarget &instance, unsigned long long command, int nbits);
+    std::future<BatchResult> read(const VjtagTarget &instance, const BitSpan &command, int nbits);
+    // Shift `data` into the DR and return what it shifts out
+    std::future<BatchResult> exchange(const VjtagTarget &instance, unsigned long long command, const BitSpan &data);
+    std::future<BatchResult> exchange(const VjtagTarget &instance, const BitSpan &command, const BitSpan &data);
+
+    // The calls before are sent before the calls after, see VjtagBatch::barrier
+    void barrier() { m_scans.barrier(); }
+
+    int size() const { return m_scans.size(); }
+    // An estimate of the cost of submit(), see VjtagBatch::estimate
+    ScanCost estimate() { return m_scans.estimate(); }
+    VjtagBatch &scans() { return m_scans; }
+
+    // Run the queued calls in one round trip and fulfil their futures. Returns false if the transfer failed, in which
+    // case every result has ok == false. The batch is then empty and can take the next calls.
+    bool submit();
+
+private:
+    Batch(const Batch &);
+    Batch &operator=(const Batch &);
+
+    struct Operation {
+        int index;              // in m_scans
+        int nbits;              // TDO bits to return, 0 if the scan is not read
+        std::promise<BatchResult> result;
+    };
+
+    std::future<BatchResult> queue(int index, int nbits);
+    void fail_pending();
+
+    VjtagBatch m_scans;
+    std::vector<Operation> m_operations;
+    std::vector<BYTE> m_zeros;  // the TDI of read()
+};
+
+#endif // JTAG_BATCH_H
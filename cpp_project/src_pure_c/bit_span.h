@@ -0,0 +1,35 @@
+#ifndef BIT_SPAN_H
+#define BIT_SPAN_H
+/*
+Declares the packed bit vector used by the IR/DR shift functions.
+
+The bits are stored LSB first: bit i is ((data[i/8] >> (i%8)) & 1), and bit 0 is the first bit shifted into the JTAG
+chain. A BitSpan does not own its memory; it is a view over a caller provided byte array which must hold at least
+num_bytes() bytes. This layout is the same as the one used by the ByteShift mode, so full bytes can be sent (and read
+back) without expanding them into one byte per bit.
+*/
+#include <string.h>
+#include "ftd2xx.h"
+
+struct BitSpan {
+    BYTE *data;   // packed bits, LSB first
+    int length;   // number of bits
+
+    BitSpan() : data(NULL), length(0) {}
+    BitSpan(BYTE *data, int length) : data(data), length(length) {}
+
+    int num_bytes() const { return (length + 7) / 8; }
+
+    BYTE get(int i) const { return (data[i >> 3] >> (i & 7)) & 0b1; }
+    void set(int i, BYTE bit){
+        if(bit & 0b1)
+            data[i >> 3] |= (BYTE)(1 << (i & 7));
+        else
+            data[i >> 3] &= (BYTE)~(1 << (i & 7));
+    }
+
+    // Set all bits (including the unused bits of the last byte) to 0
+    void clear(){ memset(data, 0, num_bytes()); }
+};
+
+#endif // BIT_SPAN_H
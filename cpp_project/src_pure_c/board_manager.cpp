@@ -0,0 +1,112 @@
+/*
+This file implements BoardManager and JtagBoard.
+*/
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include "board_manager.h"
+#include "device.h"
+
+static double now_seconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+JtagBoard::JtagBoard(const std::string &name, Transport *transport, int user1_dr_length,
+                     const TransportOptions &options)
+    : m_name(name), m_transport(transport), m_session(user1_dr_length), m_open_time(now_seconds())
+{
+    m_pipeline = new IoPipeline(m_transport, options);
+}
+
+JtagBoard::~JtagBoard()
+{
+    delete m_pipeline;  // finishes the jobs in flight while the transport is still open
+    delete m_transport;
+}
+
+double JtagBoard::seconds_open() const
+{
+    return now_seconds() - m_open_time;
+}
+
+
+BoardManager::~BoardManager()
+{
+    for(size_t i = 0; i < m_boards.size(); ++i)
+        delete m_boards[i];
+}
+
+int BoardManager::open_all(int user1_dr_length, const TransportOptions &options)
+{
+    std::vector<JtagDeviceInfo> devices;
+    if(!list_jtag_devices(devices))
+        return 0;
+
+    int opened = 0;
+    for(size_t i = 0; i < devices.size(); ++i){
+        // The location is unique even for cables without a (or with a duplicated) serial number
+        if(open_by_location(devices[i].location_id, user1_dr_length, options) != NULL)
+            ++opened;
+    }
+    return opened;
+}
+
+JtagBoard *BoardManager::open_by_serial(const char *serial_number, int user1_dr_length,
+                                        const TransportOptions &options)
+{
+    FT_HANDLE ftHandle = open_jtag_device_by_serial(serial_number, options);
+    if(ftHandle == NULL)
+        return NULL;
+    return add_board(serial_number, new FtdiTransport(ftHandle), user1_dr_length, options);
+}
+
+JtagBoard *BoardManager::open_by_location(DWORD location_id, int user1_dr_length, const TransportOptions &options)
+{
+    FT_HANDLE ftHandle = open_jtag_device_by_location(location_id, options);
+    if(ftHandle == NULL)
+        return NULL;
+    char name[32];
+    snprintf(name, sizeof(name), "loc%lX", (unsigned long) location_id);
+    return add_board(name, new FtdiTransport(ftHandle), user1_dr_length, options);
+}
+
+JtagBoard *BoardManager::add_board(const std::string &name, Transport *transport, int user1_dr_length,
+                                   const TransportOptions &options)
+{
+    JtagBoard *board = new JtagBoard(name, transport, user1_dr_length, options);
+    m_boards.push_back(board);
+    return board;
+}
+
+JtagBoard *BoardManager::find(const std::string &name)
+{
+    for(size_t i = 0; i < m_boards.size(); ++i){
+        if(m_boards[i]->name() == name)
+            return m_boards[i];
+    }
+    return NULL;
+}
+
+void BoardManager::run_parallel(const std::function<void(JtagBoard &)> &fn)
+{
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < m_boards.size(); ++i)
+        threads.push_back(std::thread(fn, std::ref(*m_boards[i])));
+    for(size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+}
+
+void BoardManager::print_stats()
+{
+    printf("%-16s %10s %8s %14s %14s %10s\n", "board", "jobs", "failed", "written", "read", "KB/s");
+    for(size_t i = 0; i < m_boards.size(); ++i){
+        JtagBoard &board = *m_boards[i];
+        IoStats stats = board.stats();
+        double seconds = board.seconds_open();
+        printf("%-16s %10llu %8llu %14llu %14llu %10.1f\n", board.name().c_str(),
+               stats.jobs_completed, stats.jobs_failed, stats.bytes_written, stats.bytes_read,
+               (seconds > 0)? stats.bytes_written / 1024.0 / seconds : 0.0);
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef JTAG_BOARD_MANAGER_H
+#define JTAG_BOARD_MANAGER_H
+/*
+Declares BoardManager, which drives several USB-Blasters (e.g. a rack of DE0-Nanos) from one process.
+
+Every board gets its own Transport, its own JtagSession and its own IoPipeline, i.e. its own writer and reader threads.
+Nothing is shared between the boards, so the USB transfers of different boards overlap and the throughput scales with
+the number of boards (as long as they are on different USB host controllers or the host is not saturated).
+
+A JtagSession is not thread-safe. Encode the buffers of a board from one thread at a time, e.g. with run_parallel(),
+which gives every board its own calling thread.
+
+Usage:
+    BoardManager boards;
+    boards.open_all(USER1_DR_LENGTH);
+    boards.run_parallel([](JtagBoard &board){
+        ... encode with board.session(), board.pipeline().submit(...), board.pipeline().wait() ...
+    });
+    boards.print_stats();
+*/
+#include <functional>
+#include <string>
+#include <vector>
+#include "ftd2xx.h"
+#include "transport.h"
+#include "session.h"
+#include "pipeline.h"
+
+class JtagBoard {
+public:
+    // The board owns the transport
+    JtagBoard(const std::string &name, Transport *transport, int user1_dr_length,
+              const TransportOptions &options = TransportOptions());
+    ~JtagBoard();
+
+    const std::string &name() const { return m_name; }
+    Transport &transport() { return *m_transport; }
+    JtagSession &session() { return m_session; }
+    IoPipeline &pipeline() { return *m_pipeline; }
+
+    IoStats stats() { return m_pipeline->stats(); }
+    double seconds_open() const;
+
+private:
+    JtagBoard(const JtagBoard &);
+    JtagBoard &operator=(const JtagBoard &);
+
+    std::string m_name;
+    Transport *m_transport;
+    JtagSession m_session;
+    IoPipeline *m_pipeline;
+    double m_open_time;
+};
+
+class BoardManager {
+public:
+    BoardManager() {}
+    ~BoardManager();  // closes all the boards
+
+    // Open every USB-Blaster found by list_jtag_devices (device.h). Returns the number of boards opened.
+    int open_all(int user1_dr_length, const TransportOptions &options = TransportOptions());
+    // Open one USB-Blaster. Returns NULL if it cannot be opened.
+    JtagBoard *open_by_serial(const char *serial_number, int user1_dr_length,
+                              const TransportOptions &options = TransportOptions());
+    JtagBoard *open_by_location(DWORD location_id, int user1_dr_length,
+                                const TransportOptions &options = TransportOptions());
+    // Add a board with any transport, e.g. a BlasterEmulator. The manager owns the transport.
+    JtagBoard *add_board(const std::string &name, Transport *transport, int user1_dr_length,
+                         const TransportOptions &options = TransportOptions());
+
+    int size() const { return (int) m_boards.size(); }
+    JtagBoard &board(int i) { return *m_boards[i]; }
+    JtagBoard *find(const std::string &name);
+
+    // Call `fn` for every board, each on its own thread, and return when all of them returned
+    void run_parallel(const std::function<void(JtagBoard &)> &fn);
+
+    // One line per board: jobs, failed jobs, bytes written and read, and the write throughput since it was opened
+    void print_stats();
+
+private:
+    BoardManager(const BoardManager &);
+    BoardManager &operator=(const BoardManager &);
+
+    std::vector<JtagBoard *> m_boards;
+};
+
+#endif // JTAG_BOARD_MANAGER_H
@@ -0,0 +1,49 @@
+/*
+This file implements CommandBuffer and CommandBufferPool.
+*/
+#include "command_buffer.h"
+
+void CommandBuffer::grow(int needed)
+{
+    int capacity = (int) m_bytes.size();
+    capacity += capacity / 2;
+    m_bytes.resize((needed > capacity)? needed : capacity);
+}
+
+void CommandBuffer::lend(std::vector<BYTE> &write_buf)
+{
+    write_buf.swap(m_bytes);
+    write_buf.resize(m_cnt);  // shrinking keeps the allocation
+}
+
+void CommandBuffer::take_back(std::vector<BYTE> &write_buf)
+{
+    write_buf.resize(write_buf.capacity());
+    m_bytes.swap(write_buf);
+    write_buf.clear();
+}
+
+
+CommandBufferPool::~CommandBufferPool()
+{
+    for(size_t i = 0; i < m_free.size(); ++i)
+        delete m_free[i];
+}
+
+CommandBuffer *CommandBufferPool::acquire()
+{
+    if(m_free.empty()){
+        ++m_allocated;
+        return new CommandBuffer();
+    }
+    CommandBuffer *buffer = m_free.back();
+    m_free.pop_back();
+    buffer->clear();
+    return buffer;
+}
+
+void CommandBufferPool::release(CommandBuffer *buffer)
+{
+    if(buffer != NULL)
+        m_free.push_back(buffer);
+}
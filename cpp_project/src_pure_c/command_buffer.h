@@ -0,0 +1,80 @@
+#ifndef JTAG_COMMAND_BUFFER_H
+#define JTAG_COMMAND_BUFFER_H
+/*
+Declares CommandBuffer, a growable byte buffer for the encoders of jtag_tap.h, and CommandBufferPool, which recycles
+them.
+
+The encoders take `BYTE *buf, int &cnt` and write without any bounds check, which keeps the inner loops tight but
+leaves sizing the buffer to the caller. A CommandBuffer does the sizing at the granularity of a scan: the CommandBuffer
+overloads (jtag_tap.h, tap_state.h, session.h) reserve the worst case of the whole scan once (max_scan_bytes()) and then
+run the unchecked encoder on data()/cnt(). The atomic_state_trans_* functions keep their raw form; a caller mixing them
+in reserves for them itself.
+
+A buffer keeps the capacity it grew to when cleared. Taking the buffers from a CommandBufferPool (one per JtagSession)
+and releasing them after every batch therefore stops the heap allocations once the pool has seen the largest batch.
+
+Usage:
+    CommandBuffer buf;
+    common_functions_ANY_to_RST_to_IDL(buf);
+    common_functions_IDL_to_SDR_to_IDL(buf, data, true);
+    buf.reserve(2);
+    atomic_state_trans_IDL_to_IDL(buf.data(), buf.cnt());
+    transport->write(buf.data(), buf.size(), written);
+*/
+#include <assert.h>
+#include <vector>
+#include "ftd2xx.h"
+
+class CommandBuffer {
+public:
+    explicit CommandBuffer(int capacity = 4096) : m_bytes(capacity), m_cnt(0) {}
+
+    BYTE *data() { return m_bytes.data(); }
+    const BYTE *data() const { return m_bytes.data(); }
+    int size() const { return m_cnt; }
+    bool empty() const { return m_cnt == 0; }
+    int capacity() const { return (int) m_bytes.size(); }
+    // The write index, for the `BYTE *buf, int &cnt` functions
+    int &cnt() { return m_cnt; }
+
+    // Make room for `nbytes` more bytes. The capacity grows by at least half, so reserving scan by scan is amortized.
+    void reserve(int nbytes) {
+        if(m_cnt + nbytes > (int) m_bytes.size())
+            grow(m_cnt + nbytes);
+    }
+    void clear() { m_cnt = 0; }
+    // The bounds check of a reservation, after the unchecked encoders wrote into it
+    void check() const { assert(m_cnt <= (int) m_bytes.size()); }
+
+    // Hand the bytes to `write_buf` (e.g. IoJob::write_buf, sized to size()) without copying, and take the storage back
+    // after the write. The buffer must not be used in between.
+    void lend(std::vector<BYTE> &write_buf);
+    void take_back(std::vector<BYTE> &write_buf);
+
+private:
+    void grow(int needed);
+
+    std::vector<BYTE> m_bytes;  // the whole capacity; the bytes past m_cnt are scratch
+    int m_cnt;
+};
+
+class CommandBufferPool {
+public:
+    CommandBufferPool() : m_allocated(0) {}
+    ~CommandBufferPool();
+
+    // A cleared buffer, recycled if one was released
+    CommandBuffer *acquire();
+    void release(CommandBuffer *buffer);
+
+    int allocated() const { return m_allocated; }  // the number of buffers ever allocated
+
+private:
+    CommandBufferPool(const CommandBufferPool &);
+    CommandBufferPool &operator=(const CommandBufferPool &);
+
+    std::vector<CommandBuffer *> m_free;
+    int m_allocated;
+};
+
+#endif // JTAG_COMMAND_BUFFER_H
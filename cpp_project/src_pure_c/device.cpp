@@ -1,9 +1,13 @@
 /*
 This file handles the device operation.
 */
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <mutex>
 #include "ftd2xx.h"
 #include "jtag_tap.h"
+#include "device.h"
 
 static bool b_str_equal_first(const char *s1, const char *s2, int imax){
     for(int i = 0; i < imax; ++i){
@@ -14,67 +18,474 @@ static bool b_str_equal_first(const char *s1, const char *s2, int imax){
 }
 
 
-FT_HANDLE open_jtag_device()
+static void configure_timing(FT_HANDLE ftHandle, const TransportOptions &options)
+{
+    FT_SetTimeouts(ftHandle,options.read_timeout_ms,options.write_timeout_ms);
+    FT_SetLatencyTimer(ftHandle,options.latency_timer);
+    FT_SetUSBParameters(ftHandle,options.usb_transfer_size,options.usb_transfer_size);
+}
+
+static void configure_jtag_device(FT_HANDLE ftHandle, const TransportOptions &options)
+{
+    FT_SetBitMode(ftHandle,0,0x40);
+    FT_Purge(ftHandle, FT_PURGE_RX | FT_PURGE_TX);
+
+    // Set the timing configuration
+    FT_SetBaudRate(ftHandle,FT_BAUD_460800);
+    configure_timing(ftHandle, options);
+}
+
+static bool same_timing(const TransportOptions &a, const TransportOptions &b)
 {
-    // define for device
-    FT_HANDLE   ftHandle = NULL;          //Handle of FT2232H device port
+    return a.usb_transfer_size == b.usb_transfer_size && a.latency_timer == b.latency_timer &&
+           a.read_timeout_ms == b.read_timeout_ms && a.write_timeout_ms == b.write_timeout_ms;
+}
+
+
+// === The handles opened by this process =======================================
+// Every open handle is registered with what is known about its device and the options it was configured with, so
+// that a handle released to the pool can be handed out again to a matching open call.
+struct OpenHandle {
+    FT_HANDLE handle;
+    JtagDeviceInfo info;      // location_id == 0 or an empty serial_number if unknown
+    TransportOptions options;
+    bool pooled;
+};
+static std::mutex s_handles_mutex;
+static std::vector<OpenHandle> s_handles;
+
+static void register_handle(FT_HANDLE ftHandle, const JtagDeviceInfo &info, const TransportOptions &options)
+{
+    OpenHandle h;
+    h.handle = ftHandle;
+    h.info = info;
+    h.options = options;
+    h.pooled = false;
+    std::lock_guard<std::mutex> lock(s_handles_mutex);
+    s_handles.push_back(h);
+}
 
-    // define for open
+// Take a pooled handle of the device with the serial number (if not NULL) or at the location (if not 0), or of any
+// device if neither is given. Returns NULL if there is none.
+static FT_HANDLE take_pooled_handle(const char *serial_number, DWORD location_id, const TransportOptions &options)
+{
+    std::lock_guard<std::mutex> lock(s_handles_mutex);
+    for (size_t i = 0; i < s_handles.size(); ++i) {
+        OpenHandle &h = s_handles[i];
+        if (!h.pooled)
+            continue;
+        if (serial_number != NULL && strcmp(h.info.serial_number, serial_number) != 0)
+            continue;
+        if (location_id != 0 && h.info.location_id != location_id)
+            continue;
+        h.pooled = false;
+        // The handle is still configured; only drop what the previous user left in the buffers
+        FT_Purge(h.handle, FT_PURGE_RX | FT_PURGE_TX);
+        if (!same_timing(h.options, options)) {
+            configure_timing(h.handle, options);
+            h.options = options;
+        }
+        return h.handle;
+    }
+    return NULL;
+}
+
+static void init_device_info(JtagDeviceInfo &info)
+{
+    memset(&info, 0, sizeof(info));
+}
+
+bool list_jtag_devices(std::vector<JtagDeviceInfo> &devices)
+{
+    // define for listing
     FT_STATUS   ftStatus;
     FT_HANDLE   ftHandleTemp;
     DWORD       numDevs, iSel, Flags, ID, Type, LocId;
     char        SerialNumber[16];
     char        Description[64];
 
-    // auto-selecting a device
-    if (FT_CreateDeviceInfoList(&numDevs) == FT_OK) {
-        for (iSel = 0; iSel < numDevs; iSel++) {
-            ftStatus = FT_GetDeviceInfoDetail(iSel, &Flags, &Type, &ID, &LocId, SerialNumber, Description, &ftHandleTemp);
-            if (ftStatus == FT_OK) {
-                //printf("Dev=%i %s\n",iSel,Description);
-                if(b_str_equal_first(Description,"USB-Blaster",11))
-                    break;
-            }
-        }
-        if(iSel == numDevs){ // not found a USB-Blaster device
-            printf("The USB-Blaster device is not found.\n");
-            return NULL;
+    devices.clear();
+    if (FT_CreateDeviceInfoList(&numDevs) != FT_OK) {
+        printf("Listing device error!\n");
+        return false;
+    }
+    for (iSel = 0; iSel < numDevs; iSel++) {
+        ftStatus = FT_GetDeviceInfoDetail(iSel, &Flags, &Type, &ID, &LocId, SerialNumber, Description, &ftHandleTemp);
+        if (ftStatus == FT_OK && b_str_equal_first(Description,"USB-Blaster",11)) {
+            JtagDeviceInfo info;
+            info.index = iSel;
+            info.location_id = LocId;
+            memcpy(info.serial_number, SerialNumber, sizeof(info.serial_number));
+            memcpy(info.description, Description, sizeof(info.description));
+            info.serial_number[sizeof(info.serial_number)-1] = 0;
+            info.description[sizeof(info.description)-1] = 0;
+            devices.push_back(info);
         }
     }
-    else{
-        printf("Listing device error!\n");
+    return true;
+}
+
+
+FT_HANDLE open_jtag_device()
+{
+    return open_jtag_device(TransportOptions());
+}
+
+// Open the device recorded in the cache file directly, without enumerating the devices. The device has to still be a
+// USB-Blaster with the same serial number, in case another cable was plugged into the same port.
+static FT_HANDLE open_cached_device(const char *cache_file, const TransportOptions &options)
+{
+    JtagDeviceInfo cached;
+    if (!load_jtag_device_cache(cache_file, cached))
+        return NULL;
+
+    FT_HANDLE ftHandle = take_pooled_handle(cached.serial_number[0]? cached.serial_number : NULL,
+                                            cached.location_id, options);
+    if (ftHandle != NULL)
+        return ftHandle;
+
+    FT_STATUS ftStatus;
+    if (cached.location_id != 0)
+        ftStatus = FT_OpenEx((PVOID)(uintptr_t) cached.location_id, FT_OPEN_BY_LOCATION, &ftHandle);
+    else
+        ftStatus = FT_OpenEx((PVOID) cached.serial_number, FT_OPEN_BY_SERIAL_NUMBER, &ftHandle);
+    if (ftStatus != FT_OK)
+        return NULL;
+
+    FT_DEVICE   Type;
+    DWORD       ID;
+    char        SerialNumber[16];
+    char        Description[64];
+    if (FT_GetDeviceInfo(ftHandle, &Type, &ID, SerialNumber, Description, NULL) != FT_OK ||
+        !b_str_equal_first(Description,"USB-Blaster",11) ||
+        (cached.serial_number[0] && strncmp(SerialNumber, cached.serial_number, sizeof(SerialNumber)) != 0)) {
+        FT_Close(ftHandle);
         return NULL;
     }
+    configure_jtag_device(ftHandle, options);
+    register_handle(ftHandle, cached, options);
+    return ftHandle;
+}
 
-    // Open
-    if (iSel >= 0) {
-        if (FT_Open(iSel,&ftHandle) == FT_OK) {
-            FT_SetBitMode(ftHandle,0,0x40);
-            FT_SetTimeouts(ftHandle,5,0);
-            FT_Purge(ftHandle, FT_PURGE_RX | FT_PURGE_TX);
-            printf("Open successfully\n");
-        }
+FT_HANDLE open_jtag_device(const TransportOptions &options)
+{
+    // Try the cached device (pooled or opened directly), then any handle of this process released to the pool
+    FT_HANDLE ftHandle = NULL;
+    if (options.device_cache_file != NULL)
+        ftHandle = open_cached_device(options.device_cache_file, options);
+    if (ftHandle == NULL)
+        ftHandle = take_pooled_handle(NULL, 0, options);
+    if (ftHandle != NULL)
+        return ftHandle;
+
+    // auto-selecting a device
+    std::vector<JtagDeviceInfo> devices;
+    if (!list_jtag_devices(devices))
+        return NULL;
+    if (devices.empty()) { // not found a USB-Blaster device
+        printf("The USB-Blaster device is not found.\n");
+        return NULL;
     }
-    else{
+
+    // Open
+    if (FT_Open(devices[0].index,&ftHandle) != FT_OK) {
         printf("Open fail\n");
         return NULL;
     }
-
-    // Set the timing configuration
-    FT_SetBaudRate(ftHandle,FT_BAUD_460800);
-    FT_SetTimeouts(ftHandle,50,0);
-    FT_SetLatencyTimer(ftHandle,2);
+    configure_jtag_device(ftHandle, options);
+    register_handle(ftHandle, devices[0], options);
+    if (options.device_cache_file != NULL)
+        save_jtag_device_cache(options.device_cache_file, devices[0]);
+    printf("Open successfully\n");
 
     // Return the device pointer
     return ftHandle;
 }
 
+FT_HANDLE open_jtag_device_by_serial(const char *serial_number, const TransportOptions &options)
+{
+    FT_HANDLE ftHandle = take_pooled_handle(serial_number, 0, options);
+    if (ftHandle != NULL)
+        return ftHandle;
+    if (FT_OpenEx((PVOID) serial_number, FT_OPEN_BY_SERIAL_NUMBER, &ftHandle) != FT_OK) {
+        printf("Open fail: serial number %s\n", serial_number);
+        return NULL;
+    }
+    configure_jtag_device(ftHandle, options);
+    JtagDeviceInfo info;
+    init_device_info(info);
+    strncpy(info.serial_number, serial_number, sizeof(info.serial_number)-1);
+    register_handle(ftHandle, info, options);
+    return ftHandle;
+}
+
+FT_HANDLE open_jtag_device_by_location(DWORD location_id, const TransportOptions &options)
+{
+    FT_HANDLE ftHandle = take_pooled_handle(NULL, location_id, options);
+    if (ftHandle != NULL)
+        return ftHandle;
+    if (FT_OpenEx((PVOID)(uintptr_t) location_id, FT_OPEN_BY_LOCATION, &ftHandle) != FT_OK) {
+        printf("Open fail: location %lX\n", (unsigned long) location_id);
+        return NULL;
+    }
+    configure_jtag_device(ftHandle, options);
+    JtagDeviceInfo info;
+    init_device_info(info);
+    info.location_id = location_id;
+    register_handle(ftHandle, info, options);
+    return ftHandle;
+}
+
 
 void close_jtag_device(FT_HANDLE ftHandle)
 {
+    {
+        std::lock_guard<std::mutex> lock(s_handles_mutex);
+        for (size_t i = 0; i < s_handles.size(); ++i) {
+            if (s_handles[i].handle == ftHandle) {
+                s_handles.erase(s_handles.begin() + i);
+                break;
+            }
+        }
+    }
     FT_Close(ftHandle);
 }
 
+void release_jtag_device(FT_HANDLE ftHandle)
+{
+    std::lock_guard<std::mutex> lock(s_handles_mutex);
+    for (size_t i = 0; i < s_handles.size(); ++i) {
+        if (s_handles[i].handle == ftHandle) {
+            s_handles[i].pooled = true;
+            return;
+        }
+    }
+    // Not opened by open_jtag_device*(), nothing is known to match it later
+    FT_Close(ftHandle);
+}
+
+void clear_jtag_device_pool()
+{
+    std::vector<FT_HANDLE> to_close;
+    {
+        std::lock_guard<std::mutex> lock(s_handles_mutex);
+        for (size_t i = 0; i < s_handles.size(); ) {
+            if (s_handles[i].pooled) {
+                to_close.push_back(s_handles[i].handle);
+                s_handles.erase(s_handles.begin() + i);
+            }
+            else
+                ++i;
+        }
+    }
+    for (size_t i = 0; i < to_close.size(); ++i)
+        FT_Close(to_close[i]);
+}
+
+
+// The cache file is a single line: the location ID in hex and the serial number ("-" if the cable has none)
+bool load_jtag_device_cache(const char *cache_file, JtagDeviceInfo &info)
+{
+    FILE *f = fopen(cache_file, "r");
+    if (f == NULL)
+        return false;
+    init_device_info(info);
+    unsigned long location_id = 0;
+    int n = fscanf(f, "%lx %15s", &location_id, info.serial_number);
+    fclose(f);
+    if (n != 2)
+        return false;
+    info.location_id = (DWORD) location_id;
+    if (strcmp(info.serial_number, "-") == 0)
+        info.serial_number[0] = 0;
+    return info.location_id != 0 || info.serial_number[0] != 0;
+}
+
+bool save_jtag_device_cache(const char *cache_file, const JtagDeviceInfo &info)
+{
+    FILE *f = fopen(cache_file, "w");
+    if (f == NULL)
+        return false;
+    fprintf(f, "%lx %s\n", (unsigned long) info.location_id, info.serial_number[0]? info.serial_number : "-");
+    return fclose(f) == 0;
+}
+
+
+FtdiTransport::FtdiTransport(FT_HANDLE ftHandle, bool release_to_pool)
+    : m_ftHandle(ftHandle), m_release_to_pool(release_to_pool), m_events_enabled(false)
+{
+    enable_event_notification();
+}
+
+FtdiTransport::~FtdiTransport()
+{
+    disable_event_notification();
+    if(m_release_to_pool)
+        release_jtag_device(m_ftHandle);
+    else
+        close_jtag_device(m_ftHandle);
+}
+
+#ifdef _WIN32
+
+void FtdiTransport::enable_event_notification()
+{
+    m_event = CreateEvent(NULL, FALSE, FALSE, NULL);  // auto-reset
+    if(m_event == NULL)
+        return;
+    if(FT_SetEventNotification(m_ftHandle, FT_EVENT_RXCHAR, m_event) != FT_OK){
+        CloseHandle(m_event);
+        m_event = NULL;
+        return;
+    }
+    m_events_enabled = true;
+}
+
+void FtdiTransport::disable_event_notification()
+{
+    if(!m_events_enabled)
+        return;
+    FT_SetEventNotification(m_ftHandle, 0, NULL);
+    CloseHandle(m_event);
+    m_events_enabled = false;
+}
+
+void FtdiTransport::wait_readable(int timeout_ms)
+{
+    if(m_events_enabled)
+        WaitForSingleObject(m_event, timeout_ms);
+    else
+        Transport::wait_readable(timeout_ms);
+}
+
+void FtdiTransport::expect_tdo()
+{
+}
+
+#else // _WIN32
+
+void FtdiTransport::enable_event_notification()
+{
+    pthread_mutex_init(&m_event.eMutex, NULL);
+    pthread_cond_init(&m_event.eCondVar, NULL);
+    m_event.iVar = 0;
+    if(m_readable.fd() < 0 || m_wakeup.fd() < 0 || FT_SetEventNotification(m_ftHandle, FT_EVENT_RXCHAR, (PVOID) &m_event) != FT_OK){
+        pthread_cond_destroy(&m_event.eCondVar);
+        pthread_mutex_destroy(&m_event.eMutex);
+        return;
+    }
+    m_bridge_stop = false;
+    m_bridge = std::thread(&FtdiTransport::bridge_loop, this);
+    m_events_enabled = true;
+}
+
+void FtdiTransport::disable_event_notification()
+{
+    if(!m_events_enabled)
+        return;
+    FT_SetEventNotification(m_ftHandle, 0, NULL);
+    m_bridge_stop = true;
+    pthread_mutex_lock(&m_event.eMutex);
+    pthread_cond_signal(&m_event.eCondVar);
+    pthread_mutex_unlock(&m_event.eMutex);
+    m_bridge.join();
+    pthread_cond_destroy(&m_event.eCondVar);
+    pthread_mutex_destroy(&m_event.eMutex);
+    m_events_enabled = false;
+}
+
+// How long after the last write or TDO byte the bridge keeps polling the queue
+static const int BRIDGE_ACTIVE_MS = 1000;
+
+// Forward the driver's condition variable to readable_fd() and m_wakeup whenever TDO bytes are queued.
+//
+// The driver does not latch its signal, so one sent while the bridge is not waiting would be lost. While TDO bytes may
+// still be on the way (until BRIDGE_ACTIVE_MS after the last write or arriving byte), the bridge also checks the queue
+// every 5 ms, which bounds the delay a lost signal causes. Otherwise no bytes can come, so it sleeps until the driver
+// or expect_tdo() signals it, and an idle transport costs no wakeups.
+void FtdiTransport::bridge_loop()
+{
+    pthread_mutex_lock(&m_event.eMutex);
+    while(!m_bridge_stop){
+        if(std::chrono::steady_clock::now() < m_active_until){
+            timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 5000000;  // 5 ms
+            if(deadline.tv_nsec >= 1000000000){
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&m_event.eCondVar, &m_event.eMutex, &deadline);
+        }
+        else
+            pthread_cond_wait(&m_event.eCondVar, &m_event.eMutex);
+        pthread_mutex_unlock(&m_event.eMutex);
+
+        DWORD queued = 0;
+        bool arrived = FT_GetQueueStatus(m_ftHandle, &queued) == FT_OK && queued > 0;
+        if(arrived){
+            m_wakeup.notify();
+            m_readable.notify();
+        }
+
+        pthread_mutex_lock(&m_event.eMutex);
+        if(arrived)
+            m_active_until = std::chrono::steady_clock::now() + std::chrono::milliseconds(BRIDGE_ACTIVE_MS);
+    }
+    pthread_mutex_unlock(&m_event.eMutex);
+}
+
+// Wake the bridge if it sleeps, and keep it polling while the answer of the write may arrive
+void FtdiTransport::expect_tdo()
+{
+    if(!m_events_enabled)
+        return;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    pthread_mutex_lock(&m_event.eMutex);
+    bool idle = now >= m_active_until;
+    m_active_until = now + std::chrono::milliseconds(BRIDGE_ACTIVE_MS);
+    if(idle)
+        pthread_cond_signal(&m_event.eCondVar);
+    pthread_mutex_unlock(&m_event.eMutex);
+}
+
+// Sleeps on m_wakeup rather than readable_fd(), which belongs to the caller's poll/epoll loop
+void FtdiTransport::wait_readable(int timeout_ms)
+{
+    if(m_events_enabled)
+        m_wakeup.wait(timeout_ms);
+    else
+        Transport::wait_readable(timeout_ms);
+}
+
+#endif // _WIN32
+
+bool FtdiTransport::write(const BYTE *buf, DWORD nbytes, DWORD &written)
+{
+    written = 0;
+    bool ok = FT_Write(m_ftHandle, (LPVOID) buf, nbytes, &written) == FT_OK;
+    if(written > 0)
+        expect_tdo();
+    return ok;
+}
+
+bool FtdiTransport::read(BYTE *buf, DWORD nbytes, DWORD &nread)
+{
+    nread = 0;
+    return FT_Read(m_ftHandle, buf, nbytes, &nread) == FT_OK;
+}
+
+bool FtdiTransport::queue_status(DWORD &nbytes)
+{
+    nbytes = 0;
+    return FT_GetQueueStatus(m_ftHandle, &nbytes) == FT_OK;
+}
+
+void FtdiTransport::purge()
+{
+    FT_Purge(m_ftHandle, FT_PURGE_RX);
+}
+
 // // define for write
 //     DWORD       dwCount=0;
 //     BYTE        sendBuf[65536];
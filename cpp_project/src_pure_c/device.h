@@ -1,9 +1,96 @@
 #ifndef JTAG_DEVICE_H
 #define JTAG_DEVICE_H
 
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
 #include "ftd2xx.h"
+#include "transport.h"
 
+// A USB-Blaster found by list_jtag_devices()
+struct JtagDeviceInfo {
+    DWORD index;              // index for FT_Open, only valid until the device list changes
+    DWORD location_id;        // the USB port, stable as long as the cable stays in the same port
+    char serial_number[16];
+    char description[64];
+};
+
+// List all the devices whose description starts with "USB-Blaster"
+bool list_jtag_devices(std::vector<JtagDeviceInfo> &devices);
+
+// Open the first USB-Blaster and configure it with the options (the default options if not given)
 FT_HANDLE open_jtag_device();
+FT_HANDLE open_jtag_device(const TransportOptions &options);
+// Open a specific USB-Blaster, e.g. one of a rack of boards
+FT_HANDLE open_jtag_device_by_serial(const char *serial_number, const TransportOptions &options);
+FT_HANDLE open_jtag_device_by_location(DWORD location_id, const TransportOptions &options);
 void close_jtag_device(FT_HANDLE ftHandle);
 
+/*
+Fast reopen
+
+Enumerating the devices (FT_CreateDeviceInfoList) and configuring a fresh handle take hundreds of milliseconds on a
+busy USB host, which dominates short-lived tools. Two shortcuts avoid them:
+1. The handle pool. release_jtag_device() keeps the handle open and configured instead of closing it, and the next
+   open_jtag_device*() call for the same device (any device for open_jtag_device) takes it back after a purge.
+2. The device cache file (TransportOptions::device_cache_file). open_jtag_device() opens the device recorded in the
+   file directly with FT_OpenEx. If that fails, a pooled handle of any device is taken as without the file, and only
+   if there is none are the devices enumerated, and the file is rewritten with the device found.
+*/
+void release_jtag_device(FT_HANDLE ftHandle);
+void clear_jtag_device_pool();  // close the pooled handles
+bool load_jtag_device_cache(const char *cache_file, JtagDeviceInfo &info);
+bool save_jtag_device_cache(const char *cache_file, const JtagDeviceInfo &info);
+
+// The Transport of a USB-Blaster opened by open_jtag_device(). The handle is closed when the transport is deleted, or
+// released to the handle pool if `release_to_pool`.
+//
+// The driver notifies the transport of the arriving TDO bytes (FT_SetEventNotification with FT_EVENT_RXCHAR), so
+// wait_readable() sleeps until they land instead of polling. On Windows, the notification is an event object. On the
+// other systems, the driver signals a condition variable, which a bridge thread forwards both to readable_fd(), so
+// that the device can be served from a poll/epoll loop, and to a private signal wait_readable() sleeps on, so that
+// clearing one never eats the wakeup of the other. Without the notification, the transport falls back to polling.
+class FtdiTransport : public Transport {
+public:
+    explicit FtdiTransport(FT_HANDLE ftHandle, bool release_to_pool = false);
+    ~FtdiTransport();
+
+    FT_HANDLE handle() const { return m_ftHandle; }
+    bool event_notification() const { return m_events_enabled; }
+
+    bool write(const BYTE *buf, DWORD nbytes, DWORD &written);
+    bool read(BYTE *buf, DWORD nbytes, DWORD &nread);
+    bool queue_status(DWORD &nbytes);
+    void purge();
+
+    void wait_readable(int timeout_ms);
+    int readable_fd() { return m_readable.fd(); }
+    void clear_readable() { m_readable.clear(); }
+
+private:
+    FtdiTransport(const FtdiTransport &);
+    FtdiTransport &operator=(const FtdiTransport &);
+
+    void enable_event_notification();
+    void disable_event_notification();
+    void expect_tdo();  // TDO bytes may arrive for a while after a write
+
+    FT_HANDLE m_ftHandle;
+    bool m_release_to_pool;
+    bool m_events_enabled;
+    ReadableSignal m_readable;
+#ifdef _WIN32
+    HANDLE m_event;
+#else
+    void bridge_loop();
+
+    EVENT_HANDLE m_event;
+    std::thread m_bridge;
+    std::atomic<bool> m_bridge_stop;
+    ReadableSignal m_wakeup;  // wait_readable()'s own copy of m_readable
+    std::chrono::steady_clock::time_point m_active_until;  // until when the bridge polls, guarded by m_event.eMutex
+#endif
+};
+
 #endif // JTAG_DEVICE_H
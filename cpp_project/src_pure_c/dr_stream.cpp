@@ -0,0 +1,183 @@
+/*
+This file implements DrStream: the segments of a long DR shift and their double-buffered transfer.
+*/
+#include <string.h>
+#include "dr_stream.h"
+#include "jtag_tap.h"
+#include "ir_dr_util.h"
+
+DrStream::DrStream(ScanBatch &batch, int segment_bits)
+    : m_batch(batch), m_session(batch.session()), m_pipeline(batch.pipeline()),
+      m_segment_bits((segment_bits + 7) / 8 * 8), m_segments(0), m_idle(0)
+{
+    if(m_segment_bits <= 0)
+        m_segment_bits = DR_STREAM_SEGMENT_BITS;
+    for(int i = 0; i < 2; ++i){
+        m_buffers[i] = m_session.buffers().acquire();
+        m_offset[i] = 0;
+        m_length[i] = 0;
+    }
+}
+
+DrStream::~DrStream()
+{
+    for(int i = 0; i < 2; ++i)
+        m_session.buffers().release(m_buffers[i]);
+}
+
+void DrStream::encode_segment(CommandBuffer &buf, const BitSpan &bits, bool first, bool last, bool to_read)
+{
+    // The transitions around the shift are the raw atomic ones: reserve them along with the shift
+    buf.reserve(max_scan_bytes(bits.length) + (last? max_idle_bytes(m_idle) : 0));
+    BYTE *data = buf.data();
+    int &cnt = buf.cnt();
+    if(!first){
+        // Resume the shift where the previous segment parked, without capturing
+        atomic_state_trans_PAU_to_EX2(data, cnt);
+        atomic_state_trans_EX2_to_SDR(data, cnt);
+    }
+    common_functions_SR_to_EX1(data, cnt, bits, to_read);
+    if(last){
+        atomic_state_trans_EX1_to_UPD(data, cnt);
+        atomic_state_trans_UPD_to_IDL(data, cnt);
+        idle_clocks(data, cnt, m_idle);  // the minimum idle of the instance, as JtagSession::scan_vdr
+        m_session.tap().set_state(TAP_IDL);
+    }
+    else{
+        atomic_state_trans_EX1_to_PAU(data, cnt);
+        m_session.tap().set_state(TAP_PAU_DR);
+    }
+    buf.check();
+}
+
+bool DrStream::complete(int slot, const Sink *tdo)
+{
+    IoJob *job = m_pipeline.wait();
+    m_buffers[slot]->take_back(job->write_buf);
+    if(!job->ok)
+        return false;
+    if(tdo != NULL){
+        BitSpan bits(m_bits.data(), m_length[slot]);
+        int read_cnt = 0;
+        if(!extract_TDO_bits(job->read_buf.data(), read_cnt, bits))
+            return false;
+        (*tdo)(m_offset[slot], bits);
+    }
+    return true;
+}
+
+bool DrStream::stream(const std::function<bool(CommandBuffer &)> &load, long long length, const Source &tdi,
+                      const Sink *tdo)
+{
+    // The session has to match the chain: the bytes of a batch not executed yet would be skipped
+    if(length <= 0 || m_batch.pending())
+        return false;
+
+    // The first segment carries the preamble. An invalid target is rejected before anything is encoded.
+    CommandBuffer &first = *m_buffers[0];
+    first.clear();
+    if(!load(first))
+        return false;
+    m_session.tap().goto_state(first, TAP_SDR);
+
+    m_bits.resize(m_segment_bits / 8);
+    bool ok = true;
+    int in_flight = 0;
+    int k = 0;
+    long long offset = 0;
+    for(; offset < length; ++k){
+        int slot = k % 2;
+        if(in_flight == 2){
+            ok = complete(slot, tdo);
+            --in_flight;
+            if(!ok)
+                break;
+        }
+        int n = (length - offset > m_segment_bits)? m_segment_bits : (int)(length - offset);
+        BitSpan bits(m_bits.data(), n);
+        tdi(offset, bits);
+
+        CommandBuffer &buf = *m_buffers[slot];
+        if(k > 0)
+            buf.clear();
+        encode_segment(buf, bits, k == 0, offset + n == length, tdo != NULL);
+        m_offset[slot] = offset;
+        m_length[slot] = n;
+
+        IoJob &job = m_jobs[slot];
+        buf.lend(job.write_buf);
+        job.expected_read = (tdo != NULL)? TDO_byte_count(n) : 0;
+        m_pipeline.submit(&job);
+        ++in_flight;
+        ++m_segments;
+        offset += n;
+    }
+    // The jobs complete in submission order, the oldest first
+    for(int slot = (k - in_flight) % 2; in_flight > 0; slot ^= 1, --in_flight){
+        if(!complete(slot, tdo))
+            ok = false;
+    }
+    if(!ok){
+        // The state of the chain is unknown: the next scan of the session starts with a reset (JtagTap::goto_state)
+        m_session.invalidate();
+        m_session.tap().set_state(TAP_UNKNOWN);
+    }
+    return ok;
+}
+
+bool DrStream::shift(int command, int vjtag_instance_ir_width, int vjtag_instance_addr, long long length,
+                     const Source &tdi, const Sink *tdo)
+{
+    return stream([&](CommandBuffer &buf){
+        if(!m_session.load_vir(buf, command, vjtag_instance_ir_width, vjtag_instance_addr))
+            return false;
+        m_session.load_ir(buf, IR_USER0);
+        m_idle = m_session.min_idle(vjtag_instance_addr);
+        return true;
+    }, length, tdi, tdo);
+}
+
+bool DrStream::shift(const VjtagTarget &target, const BitSpan &command, long long length, const Source &tdi,
+                     const Sink *tdo)
+{
+    return stream([&](CommandBuffer &buf){
+        if(!m_session.load_vir(buf, target, command))
+            return false;
+        m_session.load_ir(buf, IR_USER0);
+        m_idle = m_session.min_idle(target);
+        return true;
+    }, length, tdi, tdo);
+}
+
+// Segments are byte aligned (segment_bits is a multiple of 8), so the bits of the caller are copied byte-wise
+static DrStream::Source copy_from(const BitSpan &tdi)
+{
+    return [&tdi](long long offset, BitSpan &bits){
+        memcpy(bits.data, tdi.data + offset / 8, bits.num_bytes());
+    };
+}
+
+static DrStream::Sink copy_to(BitSpan *tdo)
+{
+    return [tdo](long long offset, const BitSpan &bits){
+        memcpy(tdo->data + offset / 8, bits.data, bits.num_bytes());
+    };
+}
+
+bool DrStream::shift(int command, int vjtag_instance_ir_width, int vjtag_instance_addr, const BitSpan &tdi,
+                     BitSpan *tdo)
+{
+    if(tdo != NULL && tdo->length != tdi.length)
+        return false;
+    Sink sink = copy_to(tdo);
+    return shift(command, vjtag_instance_ir_width, vjtag_instance_addr, tdi.length, copy_from(tdi),
+                 (tdo != NULL)? &sink : NULL);
+}
+
+bool DrStream::shift(const VjtagTarget &target, const BitSpan &command, const BitSpan &tdi, BitSpan *tdo)
+{
+    if(tdo != NULL && tdo->length != tdi.length)
+        return false;
+    Sink sink = copy_to(tdo);
+    return shift(target, command, tdi.length, copy_from(tdi), (tdo != NULL)? &sink : NULL);
+}
@@ -0,0 +1,97 @@
+#ifndef JTAG_DR_STREAM_H
+#define JTAG_DR_STREAM_H
+/*
+Declares DrStream, which shifts an arbitrarily long virtual DR (megabits) as one DR scan, in segments that park the tap
+controller in [Pause_DR] between the USB transfers.
+
+A DR scan encoded in one buffer takes up to 2 bytes per bit, and its TDO bytes come back only after the whole buffer is
+written. DrStream instead splits the shift into segments of segment_bits() bits. Every segment ends with
+[Exit1_DR] -> [Pause_DR], and the next one resumes with [Pause_DR] -> [Exit2_DR] -> [Shift_DR]. Neither path goes
+through [Capture_DR] or [Update_DR], so the FPGA sees one DR shift of the whole length: the data register keeps shifting
+where it stopped, and is updated once, after the last bit.
+
+Each segment is one IoPipeline job (pipeline.h). Two jobs are kept in flight, so the next segment is encoded while the
+previous one is on the wire, and the TDO bits of a segment are handed out as soon as it completes. The memory in use is
+therefore bounded by two segments, whatever the length of the shift. The buffers come from the session's
+CommandBufferPool.
+
+A stream runs on the JtagSession and the IoPipeline of a ScanBatch, so the IR/VIR caches and the tap controller state
+stay in step with the batch (and with Batch/RegisterBus built on it), and a single reader thread drains the transport.
+The VIR and the IR are loaded through the session before the first segment, and the minimum idle of the instance
+(JtagSession::set_min_idle) is added after the last segment. The batch must have no request waiting for execute()
+while a stream runs.
+
+Usage:
+    ScanBatch batch(transport, USER1_DR_LENGTH);
+    DrStream stream(batch);
+    stream.shift(command, ir_width, addr, tdi, &tdo);  // tdi/tdo: BitSpans of the same (any) length
+    // or, with the bits produced and consumed on the fly:
+    stream.shift(target, command, length,
+                 [&](long long offset, BitSpan &bits){ ... fill bits.length bits from `offset` ... },
+                 [&](long long offset, const BitSpan &bits){ ... store the TDO bits from `offset` ... });
+*/
+#include <functional>
+#include "ftd2xx.h"
+#include "bit_span.h"
+#include "transport.h"
+#include "session.h"
+#include "pipeline.h"
+#include "scan_batch.h"
+
+// The default bits per segment: 512 Kbit, i.e. 64 KB of ByteShift data per USB transfer
+#define DR_STREAM_SEGMENT_BITS (1 << 19)
+
+class DrStream {
+public:
+    // Produces the TDI bits of the segment starting at bit `offset` of the shift: `bits.length` bits into `bits.data`
+    typedef std::function<void(long long offset, BitSpan &bits)> Source;
+    // Receives the TDO bits of the segment starting at bit `offset` of the shift
+    typedef std::function<void(long long offset, const BitSpan &bits)> Sink;
+
+    // The batch is not owned and must outlive the stream. `segment_bits` is rounded up to a multiple of 8.
+    explicit DrStream(ScanBatch &batch, int segment_bits = DR_STREAM_SEGMENT_BITS);
+    ~DrStream();
+
+    JtagSession &session() { return m_session; }
+    int segment_bits() const { return m_segment_bits; }
+
+    // Shift `length` (> 0) bits through the DR of the instance while `command` is in its VIR. The TDO bits are read
+    // only if `tdo` is given. Returns false if the target or the command is invalid or the batch has pending requests
+    // (nothing is sent), or if a transfer failed, in which case the tap controller is reset before the next scan of
+    // the session.
+    bool shift(int command, int vjtag_instance_ir_width, int vjtag_instance_addr, long long length,
+               const Source &tdi, const Sink *tdo);
+    bool shift(const VjtagTarget &target, const BitSpan &command, long long length, const Source &tdi,
+               const Sink *tdo);
+    // The same with the bits in memory. tdo->length must be tdi.length.
+    bool shift(int command, int vjtag_instance_ir_width, int vjtag_instance_addr, const BitSpan &tdi, BitSpan *tdo);
+    bool shift(const VjtagTarget &target, const BitSpan &command, const BitSpan &tdi, BitSpan *tdo);
+
+    // The number of segments sent so far
+    unsigned long long segments() const { return m_segments; }
+
+private:
+    DrStream(const DrStream &);
+    DrStream &operator=(const DrStream &);
+
+    // The preamble (reset, VIR and IR loads) is encoded by `load`; false if the target or the command is invalid
+    bool stream(const std::function<bool(CommandBuffer &)> &load, long long length, const Source &tdi,
+                const Sink *tdo);
+    void encode_segment(CommandBuffer &buf, const BitSpan &bits, bool first, bool last, bool to_read);
+    bool complete(int slot, const Sink *tdo);
+
+    ScanBatch &m_batch;
+    JtagSession &m_session;
+    IoPipeline &m_pipeline;
+    int m_segment_bits;
+    unsigned long long m_segments;
+    int m_idle;                  // the minimum idle of the instance being streamed (JtagSession::set_min_idle)
+
+    IoJob m_jobs[2];
+    CommandBuffer *m_buffers[2];
+    long long m_offset[2];       // per job, the first bit of its segment
+    int m_length[2];             // per job, the bits of its segment
+    std::vector<BYTE> m_bits;    // the TDI, then the TDO bits of a segment
+};
+
+#endif // JTAG_DR_STREAM_H
@@ -0,0 +1,376 @@
+/*
+This file implements the USB-Blaster emulator. See emulator.h for what is modeled.
+*/
+#include <string.h>
+#include <chrono>
+#include "emulator.h"
+#include "ir_dr_util.h"
+
+#define EMU_TCK   0x01
+#define EMU_TMS   0x02
+#define EMU_TDI   0x10
+#define EMU_READ  0x40
+#define EMU_SHIFT 0x80
+
+#define IR_CAPTURE  0x155   // 0b0101010101, loaded to the IR shift register at Capture_IR
+
+static const unsigned IDCODE_EP4CE22 = 0x020F30DD;  // the Cyclone IV E on DE0-Nano
+static const unsigned USERCODE_DEFAULT = 0xFFFFFFFF;
+static const int HUB_VERSION = 1;
+
+
+// vJTAG_interface.v
+VjtagInterfaceModel::VjtagInterfaceModel()
+    : data_sent_to_pc(0), data_from_pc(0), m_dr0_bypass_reg(0), m_dr1(0), m_dr2(0),
+      m_dr3(0), m_dr3_phase(DR3_PHASE_ADDR), m_dr3_count(0), m_dr3_write(false), m_dr3_addr(0)
+{
+    memset(m_dr3_regs, 0, sizeof(m_dr3_regs));
+}
+
+unsigned VjtagInterfaceModel::dr3_read(unsigned addr) const
+{
+    if((addr >> 8) == (DR3_SCRATCH_ADDR >> 8))
+        return m_dr3_regs[(addr >> 2) & (DR3_SCRATCH_COUNT - 1)];
+    if((addr >> 2) == (DR3_ID_ADDR >> 2))
+        return DR3_ID;
+    if((addr >> 2) == (DR3_SWITCHES_ADDR >> 2))
+        return data_sent_to_pc;
+    return 0;
+}
+
+void VjtagInterfaceModel::dr3_tck(BYTE tdi, bool v_cdr, bool v_sdr)
+{
+    if(v_cdr){
+        m_dr3_phase = DR3_PHASE_ADDR;
+        m_dr3_count = 0;
+        return;
+    }
+    if(!v_sdr)
+        return;
+
+    unsigned shifted = ((unsigned) tdi << 31) | (m_dr3 >> 1);
+    switch(m_dr3_phase){
+    case DR3_PHASE_ADDR:
+        m_dr3 = shifted;
+        if(++m_dr3_count == 32)
+            m_dr3_phase = DR3_PHASE_WBIT;
+        break;
+    case DR3_PHASE_WBIT:
+        // m_dr3 holds the address. Load the first word to shift out.
+        m_dr3_write = tdi & 0b1;
+        m_dr3_addr = m_dr3;
+        m_dr3 = dr3_read(m_dr3_addr);
+        m_dr3_count = 0;
+        m_dr3_phase = DR3_PHASE_DATA;
+        break;
+    case DR3_PHASE_DATA:
+        m_dr3 = shifted;
+        if(++m_dr3_count == 32){
+            if(m_dr3_write && (m_dr3_addr >> 8) == (DR3_SCRATCH_ADDR >> 8))
+                m_dr3_regs[(m_dr3_addr >> 2) & (DR3_SCRATCH_COUNT - 1)] = shifted;
+            m_dr3_addr += 4;
+            m_dr3 = dr3_read(m_dr3_addr);
+            m_dr3_count = 0;
+        }
+        break;
+    }
+}
+
+void VjtagInterfaceModel::tck(BYTE tdi, bool v_cdr, bool v_sdr)
+{
+    bool select_DR1 = (ir_in == 1);
+    bool select_DR2 = (ir_in == 2);
+
+    m_dr0_bypass_reg = tdi;
+    if(select_DR1 && v_sdr)
+        m_dr1 = (BYTE)((tdi << 7) | (m_dr1 >> 1));
+    if(select_DR2){
+        if(v_cdr)
+            m_dr2 = data_sent_to_pc;
+        else if(v_sdr)
+            m_dr2 = (BYTE)((tdi << 7) | (m_dr2 >> 1));
+    }
+    if(ir_in == VJTAG_CMD_REGISTERS)
+        dr3_tck(tdi, v_cdr, v_sdr);
+}
+
+BYTE VjtagInterfaceModel::tdo() const
+{
+    if(ir_in == 1)
+        return m_dr1 & 0b1;
+    if(ir_in == 2)
+        return m_dr2 & 0b1;
+    if(ir_in == VJTAG_CMD_REGISTERS)
+        return m_dr3 & 0b1;
+    return m_dr0_bypass_reg;
+}
+
+
+BlasterEmulator::BlasterEmulator()
+    : m_usercode(USERCODE_DEFAULT), m_output_fifo_size(0), m_write_timeout_ms(1000),
+      m_shift_remaining(0), m_shift_read(false), m_tck(0), m_tms(0), m_tdi(0), m_tdo(0), m_tck_count(0),
+      m_state(TAP_RST), m_ir(IR_IDCODE), m_ir_shift(0), m_dr_shift(0), m_dr_length(1),
+      m_hub_ir(0), m_hub_info_nibble(0), m_selected_addr(0)
+{
+    m_vjtag_interface = new VjtagInterfaceModel();
+    add_node(m_vjtag_interface);
+}
+
+BlasterEmulator::~BlasterEmulator()
+{
+    for(size_t i = 0; i < m_nodes.size(); ++i)
+        delete m_nodes[i];
+}
+
+void BlasterEmulator::add_node(EmulatedVjtagNode *node)
+{
+    m_nodes.push_back(node);
+}
+
+int BlasterEmulator::vir_width() const
+{
+    int m = 4;
+    for(size_t i = 0; i < m_nodes.size(); ++i)
+        if(m_nodes[i]->ir_width() > m)
+            m = m_nodes[i]->ir_width();
+    return m;
+}
+
+int BlasterEmulator::addr_width() const
+{
+    // Enough bits for the hub (address 0) and every node
+    int n = 1;
+    while((1u << n) < m_nodes.size() + 1)
+        ++n;
+    return n;
+}
+
+unsigned BlasterEmulator::sld_info(int index) const
+{
+    if(index == 0)
+        return ((unsigned) vir_width() << 27) | ((unsigned) m_nodes.size() << 19) |
+               (SLD_MANUFACTURER_ALTERA << 8) | HUB_VERSION;
+    if(index > (int) m_nodes.size())
+        return 0;
+    const EmulatedVjtagNode *node = m_nodes[index-1];
+    return ((unsigned) node->sld_version << 27) | ((unsigned) node->sld_id << 19) |
+           (SLD_MANUFACTURER_ALTERA << 8) | (unsigned) node->sld_instance;
+}
+
+void BlasterEmulator::set_switches(BYTE sw)
+{
+    sw &= 0x0F;
+    m_vjtag_interface->data_sent_to_pc = (BYTE)((sw << 4) | sw);
+}
+
+
+void BlasterEmulator::set_output_fifo_size(size_t nbytes, int write_timeout_ms)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_output_fifo_size = nbytes;
+    m_write_timeout_ms = write_timeout_ms;
+}
+
+bool BlasterEmulator::write(const BYTE *buf, DWORD nbytes, DWORD &written)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    size_t queued = m_read_fifo.size();
+    for(written = 0; written < nbytes; ++written){
+        // A full output FIFO stalls the device until the host reads
+        if(m_output_fifo_size > 0 && m_read_fifo.size() >= m_output_fifo_size){
+            notify_readable();
+            if(!m_fifo_cv.wait_for(lock, std::chrono::milliseconds(m_write_timeout_ms),
+                                   [this]{ return m_read_fifo.size() < m_output_fifo_size; }))
+                return true;  // timed out, as FT_Write returns with fewer bytes written
+            queued = m_read_fifo.size();
+        }
+        process_byte(buf[written]);
+    }
+    if(m_read_fifo.size() > queued)
+        notify_readable();
+    return true;
+}
+
+// With m_mutex held
+void BlasterEmulator::notify_readable()
+{
+    m_fifo_cv.notify_all();
+    m_readable.notify();
+}
+
+void BlasterEmulator::wait_readable(int timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_fifo_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]{ return !m_read_fifo.empty(); });
+}
+
+bool BlasterEmulator::read(BYTE *buf, DWORD nbytes, DWORD &nread)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    nread = 0;
+    while(nread < nbytes && !m_read_fifo.empty()){
+        buf[nread++] = m_read_fifo.front();
+        m_read_fifo.pop_front();
+    }
+    if(nread > 0)
+        m_fifo_cv.notify_all();
+    return true;
+}
+
+bool BlasterEmulator::queue_status(DWORD &nbytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    nbytes = (DWORD) m_read_fifo.size();
+    return true;
+}
+
+void BlasterEmulator::purge()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_read_fifo.clear();
+    m_fifo_cv.notify_all();
+}
+
+
+void BlasterEmulator::process_byte(BYTE b)
+{
+    if(m_shift_remaining > 0){
+        // ByteShift: 8 TDI bits, LSB first, with the TMS of the last BitBanging byte
+        BYTE tdo_byte = 0;
+        for(int i = 0; i < 8; ++i){
+            m_tdi = (b >> i) & 0b1;
+            if(m_tck){
+                m_tck = 0;
+                falling_edge();
+            }
+            tdo_byte |= (BYTE)(m_tdo << i);
+            m_tck = 1;
+            rising_edge();
+        }
+        if(m_shift_read)
+            m_read_fifo.push_back(tdo_byte);
+        --m_shift_remaining;
+        return;
+    }
+
+    if(b & EMU_SHIFT){
+        m_shift_remaining = b & 0x3F;
+        m_shift_read = (b & EMU_READ) != 0;
+        return;
+    }
+
+    // BitBanging
+    BYTE tck = (b & EMU_TCK)? 1 : 0;
+    m_tms = (b & EMU_TMS)? 1 : 0;
+    m_tdi = (b & EMU_TDI)? 1 : 0;
+    if(m_tck && !tck){
+        m_tck = 0;
+        falling_edge();
+    }
+    if(b & EMU_READ)
+        m_read_fifo.push_back(m_tdo);
+    if(!m_tck && tck){
+        m_tck = 1;
+        rising_edge();
+    }
+}
+
+void BlasterEmulator::falling_edge()
+{
+    if(m_state == TAP_SIR)
+        m_tdo = m_ir_shift & 0b1;
+    else if(m_state == TAP_SDR){
+        if(m_ir == IR_USER0 && m_selected_addr > 0)
+            m_tdo = m_nodes[m_selected_addr-1]->tdo();
+        else
+            m_tdo = m_dr_shift & 0b1;
+    }
+}
+
+void BlasterEmulator::capture_dr()
+{
+    switch(m_ir){
+    case IR_IDCODE:
+        m_dr_shift = IDCODE_EP4CE22;
+        m_dr_length = 32;
+        break;
+    case IR_USERCODE:
+        m_dr_shift = m_usercode;
+        m_dr_length = 32;
+        break;
+    case IR_USER1:
+        m_dr_shift = 0;
+        m_dr_length = user1_dr_length();
+        break;
+    case IR_USER0:
+        if(m_selected_addr == 0 && m_hub_ir == HUB_INFO){
+            // The hub info, then the info of every node, 4 bits per capture (see sld_info)
+            int word = m_hub_info_nibble / 8;
+            int nibble = m_hub_info_nibble % 8;
+            m_dr_shift = (sld_info(word) >> (4 * nibble)) & 0xF;
+            m_dr_length = 4;
+            if(word <= (int) m_nodes.size())
+                ++m_hub_info_nibble;
+            break;
+        }
+        m_dr_shift = 0;
+        m_dr_length = 1;
+        break;
+    default:  // BYPASS, and USER0 while the hub itself is selected
+        m_dr_shift = 0;
+        m_dr_length = 1;
+        break;
+    }
+}
+
+void BlasterEmulator::update_user1()
+{
+    int m = vir_width();
+    int vir = (int)(m_dr_shift & ((1u << m) - 1));
+    int addr = (int)(m_dr_shift >> m);
+    if(addr == 0){
+        m_hub_ir = vir;  // hub instruction, e.g. VIR_CAPTURE
+        if(vir == HUB_INFO)
+            m_hub_info_nibble = 0;
+    }
+    else if(addr <= (int) m_nodes.size()){
+        EmulatedVjtagNode *node = m_nodes[addr-1];
+        node->ir_in = vir & ((1 << node->ir_width()) - 1);
+    }
+    m_selected_addr = (addr <= (int) m_nodes.size())? addr : 0;
+}
+
+void BlasterEmulator::rising_edge()
+{
+    ++m_tck_count;
+    TapState state = m_state;
+    bool user0_node = (m_ir == IR_USER0 && m_selected_addr > 0);
+
+    // Actions of the current state
+    if(state == TAP_CAP_IR)
+        m_ir_shift = IR_CAPTURE;
+    else if(state == TAP_SIR)
+        m_ir_shift = (m_ir_shift >> 1) | (m_tdi << (IR_LENGTH-1));
+    else if(state == TAP_CAP_DR && !user0_node)
+        capture_dr();
+    else if(state == TAP_SDR && !user0_node)
+        m_dr_shift = (m_dr_shift >> 1) | ((unsigned long long) m_tdi << (m_dr_length-1));
+
+    // The VJTAG instances share tck; only the selected one sees its virtual states
+    for(size_t i = 0; i < m_nodes.size(); ++i){
+        bool selected = user0_node && (int) i == m_selected_addr-1;
+        m_nodes[i]->tck(m_tdi, selected && state == TAP_CAP_DR, selected && state == TAP_SDR);
+    }
+
+    m_state = tap_next_state(state, m_tms);
+
+    // Leaving or entering the update states
+    if(state == TAP_UPD_DR && user0_node)
+        m_nodes[m_selected_addr-1]->v_udr_fall();
+    if(state != TAP_UPD_IR && m_state == TAP_UPD_IR)
+        m_ir = m_ir_shift;
+    if(state != TAP_UPD_DR && m_state == TAP_UPD_DR && m_ir == IR_USER1)
+        update_user1();
+    if(m_state == TAP_RST)
+        m_ir = IR_IDCODE;
+}
@@ -0,0 +1,170 @@
+#ifndef BLASTER_EMULATOR_H
+#define BLASTER_EMULATOR_H
+/*
+Declares BlasterEmulator, an in-process software USB-Blaster attached to a DE0-Nano running quartus_project.
+
+The emulator decodes the BitBanging/ByteShift byte protocol documented in jtag_tap.cpp and drives a model of the JTAG
+chain with it:
+1. a 16-state tap controller (tap_state.h),
+2. the 10-bit Cyclone IR with IDCODE, USERCODE, USER0, USER1 and BYPASS,
+3. the SLD hub, which decodes the USER1 DR into a hub instruction (address 0, e.g. VIR_CAPTURE) or a virtual
+   instruction for the VJTAG instance at the given address, and routes the USER0 DR to the selected instance. After
+   HUB_INFO, the USER0 DR returns the hub and node info 4 bits at a time (see hub_discovery.h),
+4. the VJTAG instances behind the hub. VjtagInterfaceModel is the C++ model of vJTAG_interface.v.
+
+The TDO bytes are queued exactly as the USB-Blaster returns them: one byte per BitBanging byte with the read bit set
+(TDO in bit 0, bit 1 is DATAOUT which always reads 0 here), and one byte of 8 TDO bits (LSB first) per ByteShift byte
+in the read mode.
+
+As in the hardware, TDI is sampled at the rising edge of TCK and TDO changes at the falling edge.
+
+write(), read() and queue_status() may be called from different threads (see pipeline.h). Like the hardware, the
+emulator can be given a bounded output FIFO (set_output_fifo_size); write() then stops consuming bytes while the FIFO
+is full of unread TDO bytes, and returns with fewer bytes written if nobody reads them within the write timeout.
+*/
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "ftd2xx.h"
+#include "transport.h"
+#include "tap_state.h"
+#include "ir_dr_util.h"
+
+// A VJTAG (sld_virtual_jtag) instance behind the SLD hub. The arguments follow the ports of the megafunction.
+class EmulatedVjtagNode {
+public:
+    EmulatedVjtagNode() : ir_in(0), sld_id(SLD_ID_VIRTUAL_JTAG), sld_instance(0), sld_version(1) {}
+    virtual ~EmulatedVjtagNode() {}
+
+    virtual int ir_width() const = 0;
+
+    // Rising edge of tck. v_cdr and v_sdr are the virtual state signals, asserted only while the hub routes the USER0
+    // DR to this instance.
+    virtual void tck(BYTE tdi, bool v_cdr, bool v_sdr) = 0;
+    virtual BYTE tdo() const = 0;
+    // Falling edge of v_udr, i.e. leaving the virtual Update_DR state
+    virtual void v_udr_fall() {}
+
+    int ir_in;  // the virtual instruction, updated by the hub
+
+    // The node info reported by the hub (the manufacturer is always Altera), see hub_discovery.h
+    int sld_id;        // 8 bits, SLD_ID_VIRTUAL_JTAG for sld_virtual_jtag
+    int sld_instance;  // 8 bits, the sld_instance_index parameter
+    int sld_version;   // 5 bits
+};
+
+// C++ model of vJTAG_interface.v. IR 1 shifts data into DR1 (copied to data_from_pc, the LEDs, when leaving the
+// virtual Update_DR), IR 2 shifts out the snapshot of data_sent_to_pc ({SW, SW}), IR 3 runs the DR3 register
+// transactions, and IR 0 is the bypass.
+class VjtagInterfaceModel : public EmulatedVjtagNode {
+public:
+    VjtagInterfaceModel();
+
+    int ir_width() const { return 2; }
+    void tck(BYTE tdi, bool v_cdr, bool v_sdr);
+    BYTE tdo() const;
+    void v_udr_fall() { data_from_pc = m_dr1; }
+
+    BYTE data_sent_to_pc;  // input
+    BYTE data_from_pc;     // output
+
+    unsigned scratch(int index) const { return m_dr3_regs[index]; }
+
+private:
+    enum Dr3Phase { DR3_PHASE_ADDR, DR3_PHASE_WBIT, DR3_PHASE_DATA };
+    unsigned dr3_read(unsigned addr) const;
+    void dr3_tck(BYTE tdi, bool v_cdr, bool v_sdr);
+
+    BYTE m_dr0_bypass_reg;
+    BYTE m_dr1;
+    BYTE m_dr2;
+
+    unsigned m_dr3;
+    Dr3Phase m_dr3_phase;
+    int m_dr3_count;
+    bool m_dr3_write;
+    unsigned m_dr3_addr;
+    unsigned m_dr3_regs[DR3_SCRATCH_COUNT];
+};
+
+class BlasterEmulator : public Transport {
+public:
+    // The Blaster_Comm design: a single vJTAG_interface at hub address 1
+    BlasterEmulator();
+    ~BlasterEmulator();
+
+    // Add a VJTAG instance (owned by the emulator) at the next hub address. Only call this before writing any byte.
+    void add_node(EmulatedVjtagNode *node);
+    EmulatedVjtagNode *node(int addr) { return m_nodes[addr-1]; }
+    VjtagInterfaceModel &vjtag_interface() { return *m_vjtag_interface; }
+
+    // USER1 DR layout: the VIR width (at least 4, required by VIR_CAPTURE) followed by the address bits
+    int vir_width() const;
+    int addr_width() const;
+    int user1_dr_length() const { return vir_width() + addr_width(); }
+
+    // The USERCODE of the design (0xFFFFFFFF unless set in the Quartus device options)
+    void set_usercode(unsigned usercode) { m_usercode = usercode; }
+
+    // DE0-Nano switches (data_sent_to_pc is {SW, SW}) and LEDs (data_from_pc)
+    void set_switches(BYTE sw);
+    BYTE leds() const { return m_vjtag_interface->data_from_pc; }
+
+    // 0 (the default) for an unbounded FIFO
+    void set_output_fifo_size(size_t nbytes, int write_timeout_ms = 1000);
+
+    TapState tap_state() const { return m_state; }
+    unsigned long long tck_count() const { return m_tck_count; }
+
+    bool write(const BYTE *buf, DWORD nbytes, DWORD &written);
+    bool read(BYTE *buf, DWORD nbytes, DWORD &nread);
+    bool queue_status(DWORD &nbytes);
+    void purge();
+
+    // write() wakes the waiters and signals readable_fd() as soon as it queues TDO bytes
+    void wait_readable(int timeout_ms);
+    int readable_fd() { return m_readable.fd(); }
+    void clear_readable() { m_readable.clear(); }
+
+private:
+    void notify_readable();
+
+    void process_byte(BYTE b);
+    void falling_edge();
+    void rising_edge();
+    void capture_dr();
+    void update_user1();
+    unsigned sld_info(int index) const;  // 0 for the hub, then the nodes
+
+    unsigned m_usercode;
+
+    std::mutex m_mutex;  // guards the whole emulated state
+    std::condition_variable m_fifo_cv;  // the output FIFO changed
+    ReadableSignal m_readable;
+    size_t m_output_fifo_size;
+    int m_write_timeout_ms;
+
+    // USB-Blaster byte protocol
+    int m_shift_remaining;     // ByteShift bytes left, 0 in the BitBanging mode
+    bool m_shift_read;
+    BYTE m_tck, m_tms, m_tdi, m_tdo;
+    std::deque<BYTE> m_read_fifo;
+    unsigned long long m_tck_count;
+
+    // Tap controller and Cyclone IR / DR
+    TapState m_state;
+    int m_ir;
+    int m_ir_shift;
+    unsigned long long m_dr_shift;  // IDCODE, USERCODE, USER1 and BYPASS DR
+    int m_dr_length;
+
+    // SLD hub
+    int m_hub_ir;
+    int m_hub_info_nibble;  // the next nibble of the HUB_INFO sequence
+    int m_selected_addr;
+    std::vector<EmulatedVjtagNode *> m_nodes;
+    VjtagInterfaceModel *m_vjtag_interface;
+};
+
+#endif // BLASTER_EMULATOR_H
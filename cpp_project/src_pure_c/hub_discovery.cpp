@@ -0,0 +1,258 @@
+/*
+This file implements the SLD hub discovery and its cache file.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "hub_discovery.h"
+#include "bit_span.h"
+#include "ir_dr_util.h"
+#include "jtag_tap.h"
+#include "tap_state.h"
+#include "pipeline.h"
+
+#define MAX_INFO_WORDS 256  // the hub and up to 255 nodes
+
+// Write the buffer and read the TDO bytes it produces. The pipeline keeps the TDO bytes in flight under the device
+// FIFO size, which a single write of the whole node table could exceed.
+static bool exchange(Transport &transport, std::vector<BYTE> &buf, int cnt, int expected_read, std::vector<BYTE> &tdo)
+{
+    IoPipeline pipeline(&transport);
+    IoJob job;
+    job.write_buf.assign(buf.begin(), buf.begin() + cnt);
+    job.expected_read = expected_read;
+    pipeline.submit(&job);
+    pipeline.wait();
+    tdo.swap(job.read_buf);
+    return job.ok;
+}
+
+// Append the scans reading `nwords` 32-bit info words, 4 bits per USER0 DR scan. The IR must hold USER0.
+static void append_info_reads(JtagTap &tap, BYTE *buf, int &cnt, int nwords)
+{
+    BYTE zero = 0;
+    BitSpan nibble(&zero, 4);
+    for(int i = 0; i < 8 * nwords; ++i)
+        tap.scan_dr(buf, cnt, nibble, true);
+    tap.goto_state(buf, cnt, TAP_IDL);
+}
+
+static void decode_info_words(const std::vector<BYTE> &tdo, int nwords, unsigned *words)
+{
+    int read_cnt = 0;
+    for(int w = 0; w < nwords; ++w){
+        words[w] = 0;
+        for(int i = 0; i < 8; ++i){
+            BYTE bits_byte = 0;
+            BitSpan nibble(&bits_byte, 4);
+            extract_TDO_bits(tdo.data(), read_cnt, nibble);
+            words[w] |= (unsigned)(bits_byte & 0xF) << (4 * i);
+        }
+    }
+}
+
+
+const SldNodeInfo *SldHubInfo::find(int id, int instance) const
+{
+    for(size_t i = 0; i < nodes.size(); ++i){
+        if(nodes[i].id == id && nodes[i].instance == instance)
+            return &nodes[i];
+    }
+    return NULL;
+}
+
+bool read_device_codes(Transport &transport, unsigned &idcode, unsigned &usercode)
+{
+    std::vector<BYTE> buf(1024);
+    int cnt = 0;
+    JtagTap tap;
+    tap.reset(buf.data(), cnt);
+    tap.goto_state(buf.data(), cnt, TAP_IDL);
+
+    BYTE ir_bytes[2], dr_bytes[4] = {0, 0, 0, 0};
+    BitSpan ir(ir_bytes, 0), dr(dr_bytes, 32);
+    prepare_IR_data(ir, IR_IDCODE);
+    tap.scan_ir(buf.data(), cnt, ir, false);
+    tap.scan_dr(buf.data(), cnt, dr, true);
+    prepare_IR_data(ir, IR_USERCODE);
+    tap.scan_ir(buf.data(), cnt, ir, false);
+    tap.scan_dr(buf.data(), cnt, dr, true);
+    tap.goto_state(buf.data(), cnt, TAP_IDL);
+
+    std::vector<BYTE> tdo;
+    if(!exchange(transport, buf, cnt, tap.expected_read(), tdo))
+        return false;
+    unsigned codes[2];
+    int read_cnt = 0;
+    for(int i = 0; i < 2; ++i){
+        extract_TDO_bits(tdo.data(), read_cnt, dr);
+        codes[i] = dr_bytes[0] | (dr_bytes[1] << 8) | (dr_bytes[2] << 16) | ((unsigned) dr_bytes[3] << 24);
+    }
+    idcode = codes[0];
+    usercode = codes[1];
+    return true;
+}
+
+// The hub scan itself, without the device codes
+static bool scan_sld_hub(Transport &transport, SldHubInfo &hub)
+{
+    // HUB_INFO to the hub: a USER1 DR of 0's longer than any hub has, then the 8 nibbles of the hub info
+    std::vector<BYTE> buf(4096);
+    int cnt = 0;
+    JtagTap tap;
+    tap.reset(buf.data(), cnt);
+    tap.goto_state(buf.data(), cnt, TAP_IDL);
+
+    BYTE ir_bytes[2], zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    BitSpan ir(ir_bytes, 0);
+    prepare_IR_data_USER1(ir);
+    tap.scan_ir(buf.data(), cnt, ir, false);
+    tap.scan_dr(buf.data(), cnt, BitSpan(zeros, 64), false);
+    prepare_IR_data_USER0(ir);
+    tap.scan_ir(buf.data(), cnt, ir, false);
+    append_info_reads(tap, buf.data(), cnt, 1);
+
+    std::vector<BYTE> tdo;
+    unsigned words[MAX_INFO_WORDS];
+    if(!exchange(transport, buf, cnt, tap.expected_read(), tdo))
+        return false;
+    decode_info_words(tdo, 1, words);
+    hub.vir_width = (words[0] >> 27) & 0x1F;
+    int nnodes = (words[0] >> 19) & 0xFF;
+    hub.manufacturer = (words[0] >> 8) & 0x7FF;
+    hub.version = words[0] & 0xFF;
+    if(hub.manufacturer != SLD_MANUFACTURER_ALTERA || hub.vir_width == 0){
+        printf("No SLD hub found (hub info %08X).\n", words[0]);
+        return false;
+    }
+    hub.addr_width = 0;
+    while((1 << hub.addr_width) < nnodes + 1)
+        ++hub.addr_width;
+
+    // The node info follows in the same sequence
+    tap.clear_expected_read();
+    cnt = 0;
+    buf.resize(64 * 8 * nnodes + 64);
+    append_info_reads(tap, buf.data(), cnt, nnodes);
+    if(!exchange(transport, buf, cnt, tap.expected_read(), tdo))
+        return false;
+    decode_info_words(tdo, nnodes, words);
+    hub.nodes.clear();
+    for(int i = 0; i < nnodes; ++i){
+        SldNodeInfo node;
+        node.addr = i + 1;
+        node.ir_width = hub.vir_width;
+        node.version = (words[i] >> 27) & 0x1F;
+        node.id = (words[i] >> 19) & 0xFF;
+        node.manufacturer = (words[i] >> 8) & 0x7FF;
+        node.instance = words[i] & 0xFF;
+        hub.nodes.push_back(node);
+    }
+    return true;
+}
+
+bool discover_sld_hub(Transport &transport, SldHubInfo &hub)
+{
+    return read_device_codes(transport, hub.idcode, hub.usercode) && scan_sld_hub(transport, hub);
+}
+
+
+// The cache file has one block per device:
+//     hub <idcode> <usercode> <vir_width> <addr_width> <manufacturer> <version> <number of nodes>
+//     node <addr> <version> <id> <manufacturer> <instance>     (once per node)
+// All numbers are in hex.
+bool load_sld_hub_cache(const char *cache_file, unsigned idcode, unsigned usercode, SldHubInfo &hub)
+{
+    FILE *f = fopen(cache_file, "r");
+    if(f == NULL)
+        return false;
+    char line[256];
+    bool found = false;
+    int nnodes = 0;
+    while(fgets(line, sizeof(line), f) != NULL){
+        unsigned id, user;
+        int m, aw, mfg, ver, n;
+        if(!found){
+            if(sscanf(line, "hub %x %x %x %x %x %x %x", &id, &user, &m, &aw, &mfg, &ver, &n) == 7 &&
+               id == idcode && user == usercode){
+                found = true;
+                hub.idcode = id;
+                hub.usercode = user;
+                hub.vir_width = m;
+                hub.addr_width = aw;
+                hub.manufacturer = mfg;
+                hub.version = ver;
+                hub.nodes.clear();
+                nnodes = n;
+            }
+            continue;
+        }
+        SldNodeInfo node;
+        if((int) hub.nodes.size() == nnodes ||
+           sscanf(line, "node %x %x %x %x %x", &node.addr, &node.version, &node.id, &node.manufacturer,
+                  &node.instance) != 5)
+            break;
+        node.ir_width = hub.vir_width;
+        hub.nodes.push_back(node);
+    }
+    fclose(f);
+    return found && (int) hub.nodes.size() == nnodes;
+}
+
+bool save_sld_hub_cache(const char *cache_file, const SldHubInfo &hub)
+{
+    // Keep the blocks of the other devices
+    std::string kept;
+    FILE *f = fopen(cache_file, "r");
+    if(f != NULL){
+        char line[256];
+        bool skipping = false;
+        while(fgets(line, sizeof(line), f) != NULL){
+            unsigned id, user;
+            if(sscanf(line, "hub %x %x", &id, &user) == 2)
+                skipping = (id == hub.idcode && user == hub.usercode);
+            if(!skipping)
+                kept += line;
+        }
+        fclose(f);
+    }
+
+    f = fopen(cache_file, "w");
+    if(f == NULL)
+        return false;
+    fputs(kept.c_str(), f);
+    fprintf(f, "hub %08X %08X %X %X %X %X %X\n", hub.idcode, hub.usercode, hub.vir_width, hub.addr_width,
+            hub.manufacturer, hub.version, (unsigned) hub.nodes.size());
+    for(size_t i = 0; i < hub.nodes.size(); ++i){
+        const SldNodeInfo &node = hub.nodes[i];
+        fprintf(f, "node %X %X %X %X %X\n", node.addr, node.version, node.id, node.manufacturer, node.instance);
+    }
+    return fclose(f) == 0;
+}
+
+bool open_sld_hub(Transport &transport, const char *cache_file, SldHubInfo &hub)
+{
+    unsigned idcode, usercode;
+    if(!read_device_codes(transport, idcode, usercode))
+        return false;
+    if(cache_file != NULL && load_sld_hub_cache(cache_file, idcode, usercode, hub))
+        return true;
+    hub.idcode = idcode;
+    hub.usercode = usercode;
+    if(!scan_sld_hub(transport, hub))
+        return false;
+    if(cache_file != NULL)
+        save_sld_hub_cache(cache_file, hub);
+    return true;
+}
+
+void print_sld_hub(const SldHubInfo &hub)
+{
+    printf("IDCODE %08X, USERCODE %08X, SLD hub version %d: VIR width %d, %d address bits, %d node(s)\n",
+           hub.idcode, hub.usercode, hub.version, hub.vir_width, hub.addr_width, (int) hub.nodes.size());
+    for(size_t i = 0; i < hub.nodes.size(); ++i){
+        const SldNodeInfo &node = hub.nodes[i];
+        printf("  node %d: manufacturer 0x%03X, id 0x%02X, instance %d, version %d\n",
+               node.addr, node.manufacturer, node.id, node.instance, node.version);
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef JTAG_HUB_DISCOVERY_H
+#define JTAG_HUB_DISCOVERY_H
+/*
+Declares the discovery of the SLD hub and the VJTAG instances behind it, so that the USER1 DR length, the VIR width
+and the instance addresses no longer have to be copied from Blaster_Comm.map.rpt.
+
+The hub reports its configuration when it is given the HUB_INFO instruction (0, at address 0, so a USER1 DR of all
+0's whatever its length). Every following USER0 DR scan then captures the next 4 bits (LSB first) of a sequence of
+32-bit words: the hub info followed by the info of every node.
+    hub info:  {m[31:27], N[26:19], manufacturer[18:8], version[7:0]}
+    node info: {version[31:27], id[26:19], manufacturer[18:8], instance[7:0]}
+m is the VIR width (the widest instance IR) and N the number of nodes. The USER1 DR holds the m VIR bits followed by
+ceil(log2(N+1)) address bits; the node i (from 1) is at address i.
+
+The hub does not report the IR width of each instance, only m. Every node therefore gets ir_width = m: the virtual
+instruction is padded with 0's up to m bits anyway, so the commands are the same.
+
+The discovered table can be cached in a text file keyed by the IDCODE and the USERCODE of the device, which
+open_sld_hub() reads (one IDCODE/USERCODE scan) instead of running the hub scan. Give every design its own USERCODE
+(Quartus: Device and Pin Options > General) for the key to tell them apart; the default USERCODE is 0xFFFFFFFF.
+*/
+#include <vector>
+#include "ftd2xx.h"
+#include "transport.h"
+#include "ir_dr_util.h"
+
+struct SldNodeInfo {
+    int addr;          // hub address, from 1
+    int ir_width;      // the VIR width of the hub, see above
+    int version;
+    int id;            // 0x08 for sld_virtual_jtag
+    int manufacturer;  // 0x06E for Altera
+    int instance;      // the sld_instance_index parameter
+};
+
+struct SldHubInfo {
+    SldHubInfo() : idcode(0), usercode(0), vir_width(0), addr_width(0), manufacturer(0), version(0) {}
+
+    unsigned idcode;
+    unsigned usercode;
+    int vir_width;     // m
+    int addr_width;
+    int manufacturer;
+    int version;
+    std::vector<SldNodeInfo> nodes;
+
+    int user1_dr_length() const { return vir_width + addr_width; }
+    // The address in the form taken by prepare_USER1DR_data_Command and JtagSession, i.e. shifted past the VIR bits
+    int command_addr(const SldNodeInfo &node) const { return node.addr << vir_width; }
+    // The node as addressed by prepare_USER1DR_data_VIR, JtagSession and VjtagBatch
+    VjtagTarget target(const SldNodeInfo &node) const {
+        return VjtagTarget(node.ir_width, node.addr, vir_width, addr_width);
+    }
+    // The node with the id and the instance index, NULL if none
+    const SldNodeInfo *find(int id, int instance) const;
+};
+
+// Read the IDCODE and the USERCODE of the device
+bool read_device_codes(Transport &transport, unsigned &idcode, unsigned &usercode);
+
+// Scan the hub. Returns false if the device has no SLD hub.
+bool discover_sld_hub(Transport &transport, SldHubInfo &hub);
+
+// Look up / store the table of the device with the IDCODE and the USERCODE in the cache file
+bool load_sld_hub_cache(const char *cache_file, unsigned idcode, unsigned usercode, SldHubInfo &hub);
+bool save_sld_hub_cache(const char *cache_file, const SldHubInfo &hub);
+
+// Read the device codes, take the table from the cache file if it has one for them, and otherwise scan the hub and
+// store the result. `cache_file` may be NULL to always scan.
+bool open_sld_hub(Transport &transport, const char *cache_file, SldHubInfo &hub);
+
+void print_sld_hub(const SldHubInfo &hub);
+
+#endif // JTAG_HUB_DISCOVERY_H
@@ -1,81 +1,117 @@
+#include <stdio.h>
 #include "ir_dr_util.h"
 
 
 
-bool prepare_IR_data_USER0(BYTE *bit_data_stored_in_byte, int &length)
+bool prepare_IR_data(BitSpan &bits, int instruction)
+{
+    bits.length = IR_LENGTH;
+    bits.data[0] = instruction & 0xFF;
+    bits.data[1] = (instruction >> 8) & 0x03;
+    return true;
+}
+
+bool prepare_IR_data_USER0(BitSpan &bits)
 {
     /*
-    Fill the array, bit_data_stored_in_byte, with the USER0 (0x00C, 10 bits) instruction.
+    Fill the packed bits with the USER0 (0x00C, 10 bits) instruction.
     */
-    bit_data_stored_in_byte[0] = 0;
-    bit_data_stored_in_byte[1] = 0;
-    bit_data_stored_in_byte[2] = 1;
-    bit_data_stored_in_byte[3] = 1;
-    bit_data_stored_in_byte[4] = 0;
-    bit_data_stored_in_byte[5] = 0;
-    bit_data_stored_in_byte[6] = 0;
-    bit_data_stored_in_byte[7] = 0;
-    bit_data_stored_in_byte[8] = 0;
-    bit_data_stored_in_byte[9] = 0;
-    length = 10;
-    return true;
+    return prepare_IR_data(bits, IR_USER0);
 }
 
-bool prepare_IR_data_USER1(BYTE *bit_data_stored_in_byte, int &length)
+bool prepare_IR_data_USER1(BitSpan &bits)
 {
     /*
-    Fill the array, bit_data_stored_in_byte, with the USER1 (0x00E, 10 bits) instruction.
+    Fill the packed bits with the USER1 (0x00E, 10 bits) instruction.
     */
-    bit_data_stored_in_byte[0] = 0;
-    bit_data_stored_in_byte[1] = 1;
-    bit_data_stored_in_byte[2] = 1;
-    bit_data_stored_in_byte[3] = 1;
-    bit_data_stored_in_byte[4] = 0;
-    bit_data_stored_in_byte[5] = 0;
-    bit_data_stored_in_byte[6] = 0;
-    bit_data_stored_in_byte[7] = 0;
-    bit_data_stored_in_byte[8] = 0;
-    bit_data_stored_in_byte[9] = 0;
-    length = 10;
-    return true;
+    return prepare_IR_data(bits, IR_USER1);
 }
 
-bool prepare_USER1DR_data_VIR_CAPTURE(BYTE *bit_data_stored_in_byte, int &length, int user1_dr_length)
+bool prepare_USER1DR_data_VIR_CAPTURE(BitSpan &bits, int user1_dr_length)
 {
-    bit_data_stored_in_byte[0] = 1;  // VIRTUAL_CAPTURE
-    bit_data_stored_in_byte[1] = 1;  // VIRTUAL_CAPTURE
-    bit_data_stored_in_byte[2] = 0;  // VIRTUAL_CAPTURE
-    bit_data_stored_in_byte[3] = 1;  // VIRTUAL_CAPTURE
-    for(int i = 4; i < user1_dr_length; ++i)
-        bit_data_stored_in_byte[i] = 0;  // VJTAG device addr, 0 for the Hub
-    length = user1_dr_length;
+    bits.length = user1_dr_length;
+    bits.clear();  // VJTAG device addr, 0 for the Hub
+    bits.set(0, 1);  // VIRTUAL_CAPTURE
+    bits.set(1, 1);  // VIRTUAL_CAPTURE
+    bits.set(2, 0);  // VIRTUAL_CAPTURE
+    bits.set(3, 1);  // VIRTUAL_CAPTURE
     return true;
 }
 
 
+bool USER1DR_data_Command_valid(int command, int vjtag_instance_ir_width, int vjtag_instance_addr, int user1_dr_length)
+{
+    // An int only holds 31 address bits; wider hubs go through prepare_USER1DR_data_VIR
+    if(vjtag_instance_ir_width <= 0 || user1_dr_length > 31)
+        return false;
+    int vir_length = (vjtag_instance_ir_width > 4)? vjtag_instance_ir_width : 4;
+    return vir_length < user1_dr_length && command >= 0 && command < (1 << vjtag_instance_ir_width) &&
+           vjtag_instance_addr >= 0 && (vjtag_instance_addr & ((1 << vir_length) - 1)) == 0 &&
+           ((unsigned) vjtag_instance_addr >> user1_dr_length) == 0;
+}
+
 bool prepare_USER1DR_data_Command(
-    BYTE *bit_data_stored_in_byte,
-    int &length,
+    BitSpan &bits,
     int command,
     int vjtag_instance_ir_width,
     int vjtag_instance_addr,
     int user1_dr_length
 ){
+    if(!USER1DR_data_Command_valid(command, vjtag_instance_ir_width, vjtag_instance_addr, user1_dr_length))
+        return false;
     int vir_length = (vjtag_instance_ir_width > 4)? vjtag_instance_ir_width : 4;  // 4, minimum required by VIR_CAPTURE
 
+    bits.length = user1_dr_length;
+    bits.clear();  // Pad 0's if needed the ir width is shorter than the length required by VIR_CAPTURE
+
     // Fill the user defined command
     for(int i = 0; i < vjtag_instance_ir_width; ++i){
-        bit_data_stored_in_byte[i] = (command>>i) & 0b1;
+        bits.set(i, (command>>i) & 0b1);
     }
 
-    // Pad 0's if needed the ir width is shorter than the length required by VIR_CAPTURE
-    for(int i = vjtag_instance_ir_width; i < vir_length; ++i)
-        bit_data_stored_in_byte[i] = 0;
-
-    // Specify the address bits
+    // Specify the address bits. vjtag_instance_addr is already shifted past the VIR bits, so bit i of the DR is bit i
+    // of the address.
     for(int i = vir_length; i < user1_dr_length; ++i)
-        bit_data_stored_in_byte[i] = (vjtag_instance_addr>>i) & 0b1;  // VJTAG device addr, 1 for the VJTAG instance
+        bits.set(i, (vjtag_instance_addr>>i) & 0b1);  // VJTAG device addr, 1 for the VJTAG instance
+
+    return true;
+}
+
 
-    length = user1_dr_length;
+bool VjtagTarget::valid() const
+{
+    return ir_width > 0 && ir_width <= vir_width && vir_width >= 4 && addr >= 0 && addr_width >= 0 &&
+           addr_width < 31 && addr < (1 << addr_width) && user1_dr_length() <= USER1_DR_MAX_LENGTH;
+}
+
+bool prepare_USER1DR_data_VIR(BitSpan &bits, const VjtagTarget &target, const BitSpan &command)
+{
+    if(!target.valid() || command.length > target.ir_width){
+        printf("Invalid VJTAG target (ir %d, addr %d, vir %d, addr width %d) or command (%d bits).\n",
+               target.ir_width, target.addr, target.vir_width, target.addr_width, command.length);
+        return false;
+    }
+
+    bits.length = target.user1_dr_length();
+    bits.clear();  // the VIR bits past the command are padded with 0's
+
+    // The command, then the address from bit vir_width on
+    for(int i = 0; i < command.length; ++i)
+        bits.set(i, command.get(i));
+    for(int i = 0; i < target.addr_width; ++i)
+        bits.set(target.vir_width + i, (target.addr >> i) & 0b1);
     return true;
 }
+
+bool prepare_USER1DR_data_VIR(BitSpan &bits, const VjtagTarget &target, unsigned long long command)
+{
+    BYTE command_bytes[8];
+    int nbits = (target.ir_width < 64)? target.ir_width : 64;
+    for(int i = 0; i < 8; ++i)
+        command_bytes[i] = (BYTE)(command >> (8 * i));
+    if(nbits < 64 && (command >> nbits) != 0){
+        printf("The command 0x%llX does not fit in %d bits.\n", command, nbits);
+        return false;
+    }
+    return prepare_USER1DR_data_VIR(bits, target, BitSpan(command_bytes, nbits));
+}
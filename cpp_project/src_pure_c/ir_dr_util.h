@@ -2,17 +2,72 @@
 #define IR_DR_UTIL
 
 #include "ftd2xx.h"
+#include "bit_span.h"
 
-bool prepare_IR_data_USER0(BYTE *bit_data_stored_in_byte, int &length);
-bool prepare_IR_data_USER1(BYTE *bit_data_stored_in_byte, int &length);
-bool prepare_USER1DR_data_VIR_CAPTURE(BYTE *bit_data_stored_in_byte, int &length, int user1_dr_length);
+// Cyclone IV instructions used by the VJTAG (10 bits)
+#define IR_LENGTH   10
+#define IR_IDCODE   0x006
+#define IR_USERCODE 0x007
+#define IR_USER0    0x00C
+#define IR_USER1    0x00E
+
+// SLD hub instructions (virtual instructions to the hub, at address 0)
+#define HUB_INFO    0x0
+#define SLD_MANUFACTURER_ALTERA 0x06E
+#define SLD_ID_VIRTUAL_JTAG     0x08    // the node id of sld_virtual_jtag
+
+// vJTAG_interface.v commands (the VIR of the instance) and its DR3 register transactions: 32 address bits, 1 write bit
+// and any number of 32-bit data words, for consecutive addresses from the given one (see vJTAG_interface.v).
+#define VJTAG_CMD_WRITE_LEDS    1
+#define VJTAG_CMD_READ_SWITCHES 2
+#define VJTAG_CMD_REGISTERS     3
+#define DR3_HEADER_LENGTH       33
+#define DR3_ID_ADDR             0x000   // reads DR3_ID
+#define DR3_SWITCHES_ADDR       0x004   // reads {SW, SW}
+#define DR3_SCRATCH_ADDR        0x100   // 64 read/write registers
+#define DR3_SCRATCH_COUNT       64
+#define DR3_ID                  0x564A5201
+
+#define USER1_DR_MAX_LENGTH 256  // bits, the largest USER1 DR the encoders below accept
+
+// A VJTAG instance as the SLD hub addresses it. The USER1 DR holds `vir_width` VIR bits followed by `addr_width`
+// address bits (LSB first). vir_width is the VIR width of the hub, i.e. the widest IR of all its instances and at least
+// 4 (VIR_CAPTURE); the virtual instructions of narrower instances are padded with 0's up to it. Unlike
+// vjtag_instance_addr of prepare_USER1DR_data_Command, `addr` is the hub address itself (from 1), not shifted.
+// SldHubInfo::target() (hub_discovery.h) builds it from the discovered table.
+struct VjtagTarget {
+    VjtagTarget() : ir_width(0), addr(0), vir_width(0), addr_width(0) {}
+    VjtagTarget(int ir_width, int addr, int vir_width, int addr_width)
+        : ir_width(ir_width), addr(addr), vir_width(vir_width), addr_width(addr_width) {}
+
+    int ir_width;    // the IR width of the instance, at most vir_width
+    int addr;
+    int vir_width;
+    int addr_width;
+
+    int user1_dr_length() const { return vir_width + addr_width; }
+    bool valid() const;
+};
+
+// The following functions fill `bits.data` (packed, LSB first; see bit_span.h) and set `bits.length`. The caller has
+// to provide enough memory in `bits.data`.
+bool prepare_IR_data(BitSpan &bits, int instruction);  // any 10-bit instruction
+bool prepare_IR_data_USER0(BitSpan &bits);
+bool prepare_IR_data_USER1(BitSpan &bits);
+bool prepare_USER1DR_data_VIR_CAPTURE(BitSpan &bits, int user1_dr_length);
 bool prepare_USER1DR_data_Command(
-    BYTE *bit_data_stored_in_byte,
-    int &length,
+    BitSpan &bits,
     int command,  // LSB is always shifted in first
     int vjtag_instance_ir_width,
     int vjtag_instance_addr,
     int user1_dr_length
 );
+// Whether prepare_USER1DR_data_Command can encode the arguments: the command fits the instance IR, and the (shifted)
+// address has no bit among the VIR bits and none past the USER1 DR, which holds at most 31 bits in this form
+bool USER1DR_data_Command_valid(int command, int vjtag_instance_ir_width, int vjtag_instance_addr, int user1_dr_length);
+// Same for any VJTAG instance of a hub with any number of instances: `command` holds up to target.ir_width bits
+// (LSB first), and the address may take any number of bits. Returns false if the target or the command does not fit.
+bool prepare_USER1DR_data_VIR(BitSpan &bits, const VjtagTarget &target, const BitSpan &command);
+bool prepare_USER1DR_data_VIR(BitSpan &bits, const VjtagTarget &target, unsigned long long command);
 
 #endif
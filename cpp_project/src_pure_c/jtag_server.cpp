@@ -0,0 +1,524 @@
+/*
+This file implements JtagServer and JtagClient over POSIX sockets.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "jtag_server.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef _WIN32
+
+static int payload_bytes(int nbits)
+{
+    return (nbits + 7) / 8;
+}
+
+static bool send_all(int fd, const void *data, size_t nbytes)
+{
+    const char *p = (const char *) data;
+    while(nbytes > 0){
+        ssize_t n = send(fd, p, nbytes, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        p += n;
+        nbytes -= n;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void *data, size_t nbytes)
+{
+    char *p = (char *) data;
+    while(nbytes > 0){
+        ssize_t n = recv(fd, p, nbytes, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        p += n;
+        nbytes -= n;
+    }
+    return true;
+}
+
+static void set_no_delay(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+
+JtagServer::JtagServer(Transport *transport, int user1_dr_length, const TransportOptions &options)
+    : m_batch(transport, user1_dr_length, options), m_unix_fd(-1), m_tcp_fd(-1), m_tcp_port(0), m_stopping(false),
+      m_batches(0), m_requests(0)
+{
+    if(pipe(m_wake_fd) != 0){
+        m_wake_fd[0] = -1;
+        m_wake_fd[1] = -1;
+    }
+}
+
+JtagServer::~JtagServer()
+{
+    for(size_t i = 0; i < m_clients.size(); ++i){
+        ::close(m_clients[i]->fd);
+        delete m_clients[i];
+    }
+    if(m_unix_fd >= 0){
+        ::close(m_unix_fd);
+        unlink(m_unix_path.c_str());
+    }
+    if(m_tcp_fd >= 0)
+        ::close(m_tcp_fd);
+    if(m_wake_fd[0] >= 0){
+        ::close(m_wake_fd[0]);
+        ::close(m_wake_fd[1]);
+    }
+}
+
+bool JtagServer::listen_unix(const char *path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        printf("Socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+        return false;
+    unlink(path);  // a socket left by a previous server
+    if(bind(fd, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 16) != 0){
+        printf("Cannot listen on %s\n", path);
+        ::close(fd);
+        return false;
+    }
+    m_unix_fd = fd;
+    m_unix_path = path;
+    return true;
+}
+
+bool JtagServer::listen_tcp(int port)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0)
+        return false;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    socklen_t len = sizeof(addr);
+    if(bind(fd, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 16) != 0 ||
+       getsockname(fd, (sockaddr *) &addr, &len) != 0){
+        printf("Cannot listen on port %d\n", port);
+        ::close(fd);
+        return false;
+    }
+    m_tcp_fd = fd;
+    m_tcp_port = ntohs(addr.sin_port);
+    return true;
+}
+
+void JtagServer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    char c = 0;
+    if(write(m_wake_fd[1], &c, 1) < 0)
+        perror("JtagServer::stop");
+}
+
+unsigned long long JtagServer::batches()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_batches;
+}
+
+unsigned long long JtagServer::requests()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_requests;
+}
+
+void JtagServer::run()
+{
+    std::vector<pollfd> fds;
+    std::vector<Pending> batch;
+    for(;;){
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if(m_stopping)
+                return;
+        }
+
+        // The wake pipe, the listening sockets, then one entry per client
+        fds.clear();
+        int listen_fds[2] = {m_unix_fd, m_tcp_fd};
+        pollfd p;
+        p.events = POLLIN;
+        p.revents = 0;
+        p.fd = m_wake_fd[0];
+        fds.push_back(p);
+        for(int i = 0; i < 2; ++i){
+            p.fd = listen_fds[i];  // poll() ignores negative fds
+            fds.push_back(p);
+        }
+        for(size_t i = 0; i < m_clients.size(); ++i){
+            Client *client = m_clients[i];
+            p.fd = client->fd;
+            p.events = 0;
+            if(!client->eof && queued(client) < JTAG_SERVER_MAX_QUEUED)
+                p.events |= POLLIN;
+            if(queued(client) > 0)
+                p.events |= POLLOUT;
+            fds.push_back(p);
+        }
+        if(poll(fds.data(), fds.size(), -1) < 0){
+            if(errno == EINTR)
+                continue;
+            perror("JtagServer::run");
+            return;
+        }
+
+        // Only the clients polled above have an entry in fds, not the ones accepted now
+        size_t nclients = m_clients.size();
+        for(int i = 0; i < 2; ++i){
+            if(fds[1+i].revents & POLLIN)
+                accept_clients(listen_fds[i]);
+        }
+
+        // Collect the complete requests of every client into one batch, except the clients that do not read their
+        // responses: their requests stay in the socket until the queue drains
+        batch.clear();
+        m_batch.clear();
+        for(size_t i = 0; i < nclients; ++i){
+            Client *client = m_clients[i];
+            if(fds[3+i].revents & (POLLOUT | POLLERR))
+                flush(client);
+            if(queued(client) >= JTAG_SERVER_MAX_QUEUED)
+                continue;
+            if(fds[3+i].revents & (POLLIN | POLLHUP | POLLERR))
+                receive(client);
+            parse(client, batch);
+        }
+        if(!batch.empty())
+            execute(batch);
+
+        // Send the responses right away; what the sockets do not take waits for POLLOUT. A client that shut down its
+        // side is closed once it has all its responses.
+        for(size_t i = 0; i < m_clients.size(); ++i)
+            flush(m_clients[i]);
+        for(size_t i = 0; i < m_clients.size(); ){
+            if(m_clients[i]->closed || (m_clients[i]->eof && queued(m_clients[i]) == 0)){
+                ::close(m_clients[i]->fd);
+                delete m_clients[i];
+                m_clients.erase(m_clients.begin() + i);
+            }
+            else
+                ++i;
+        }
+    }
+}
+
+void JtagServer::accept_clients(int listen_fd)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if(fd < 0)
+        return;
+    if(listen_fd == m_tcp_fd)
+        set_no_delay(fd);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    Client *client = new Client;
+    client->fd = fd;
+    client->out_pos = 0;
+    client->eof = false;
+    client->closed = false;
+    m_clients.push_back(client);
+}
+
+void JtagServer::receive(Client *client)
+{
+    // Bounded like the responses, which is still enough for the largest request; the rest stays in the socket
+    BYTE tmp[65536];
+    while(client->in.size() < JTAG_SERVER_MAX_QUEUED){
+        ssize_t n = recv(client->fd, tmp, sizeof(tmp), 0);
+        if(n > 0){
+            client->in.insert(client->in.end(), tmp, tmp + n);
+            continue;
+        }
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n == 0)
+            client->eof = true;  // the requests received so far are still answered
+        else if(errno != EAGAIN && errno != EWOULDBLOCK)
+            client->closed = true;
+        return;
+    }
+}
+
+void JtagServer::parse(Client *client, std::vector<Pending> &batch)
+{
+    size_t pos = 0;
+    while(!client->closed && client->in.size() - pos >= sizeof(JtagServerRequest)){
+        JtagServerRequest request;
+        memcpy(&request, client->in.data() + pos, sizeof(request));
+        int nbits = (request.op == JTAG_OP_RESET)? 0 : request.nbits;
+        if((request.op != JTAG_OP_RESET && request.op != JTAG_OP_SCAN_VDR) ||
+           nbits < 0 || nbits > JTAG_SERVER_MAX_BITS || request.ir_width < 0 || request.ir_width > 32){
+            // The payload length cannot be trusted, so the stream cannot be resynchronized: answer in order, then
+            // read nothing more and close the client once it has its responses
+            Pending pending;
+            pending.client = client;
+            pending.request = request;
+            pending.index = -1;
+            batch.push_back(pending);
+            client->eof = true;
+            pos = client->in.size();
+            break;
+        }
+        size_t nbytes = sizeof(request) + payload_bytes(nbits);
+        if(client->in.size() - pos < nbytes)
+            break;  // wait for the rest of the payload
+
+        // Encoded right away, straight from the receive buffer
+        Pending pending;
+        pending.client = client;
+        pending.request = request;
+        pending.request.nbits = nbits;
+        if(request.op == JTAG_OP_RESET){
+            pending.index = m_batch.add_reset();
+        }
+        else{
+            // A command or an address that does not fit the USER1 DR of the hub would select another instance:
+            // add_scan_vdr() rejects it (-1) and it is answered with JTAG_STATUS_BAD_REQUEST, in order
+            BitSpan bits(client->in.data() + pos + sizeof(request), nbits);
+            pending.index = m_batch.add_scan_vdr(request.command, request.ir_width, request.addr, bits,
+                                                 (request.flags & JTAG_FLAG_READ) != 0);
+        }
+        batch.push_back(pending);
+        pos += nbytes;
+    }
+    client->in.erase(client->in.begin(), client->in.begin() + pos);
+}
+
+void JtagServer::execute(std::vector<Pending> &batch)
+{
+    // One round trip for the whole batch
+    bool ok = m_batch.execute();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_batches;
+        m_requests += batch.size();
+    }
+
+    // Route the TDO bits back
+    std::vector<BYTE> tdo;
+    for(size_t i = 0; i < batch.size(); ++i){
+        Pending &p = batch[i];
+        if(p.index < 0){
+            respond(p.client, JTAG_STATUS_BAD_REQUEST, NULL, 0);
+            continue;
+        }
+        if(!ok){
+            respond(p.client, JTAG_STATUS_IO_ERROR, NULL, 0);
+            continue;
+        }
+        if(p.request.op == JTAG_OP_RESET || !(p.request.flags & JTAG_FLAG_READ)){
+            respond(p.client, JTAG_STATUS_OK, NULL, 0);
+            continue;
+        }
+        tdo.assign(payload_bytes(p.request.nbits), 0);
+        BitSpan bits(tdo.data(), p.request.nbits);
+        m_batch.tdo(p.index, bits);
+        respond(p.client, JTAG_STATUS_OK, tdo.data(), p.request.nbits);
+    }
+}
+
+void JtagServer::respond(Client *client, int status, const BYTE *tdo, int nbits)
+{
+    if(client->closed)
+        return;
+    JtagServerResponse response;
+    response.status = status;
+    response.nbits = nbits;
+    const BYTE *header = (const BYTE *) &response;
+    client->out.insert(client->out.end(), header, header + sizeof(response));
+    if(nbits > 0)
+        client->out.insert(client->out.end(), tdo, tdo + payload_bytes(nbits));
+}
+
+// Send the queued responses until the socket is full
+void JtagServer::flush(Client *client)
+{
+    while(!client->closed && queued(client) > 0){
+        ssize_t n = send(client->fd, client->out.data() + client->out_pos, queued(client), MSG_NOSIGNAL);
+        if(n > 0)
+            client->out_pos += n;
+        else if(n < 0 && errno == EINTR)
+            continue;
+        else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else
+            client->closed = true;
+    }
+    if(queued(client) == 0){
+        client->out.clear();
+        client->out_pos = 0;
+    }
+    else if(client->out_pos >= client->out.size() / 2){
+        client->out.erase(client->out.begin(), client->out.begin() + client->out_pos);
+        client->out_pos = 0;
+    }
+}
+
+
+bool JtagClient::connect_unix(const char *path)
+{
+    close();
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+        return false;
+    strcpy(addr.sun_path, path);
+
+    m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(m_fd < 0 || connect(m_fd, (sockaddr *) &addr, sizeof(addr)) != 0){
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool JtagClient::connect_tcp(int port)
+{
+    close();
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    m_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(m_fd < 0 || connect(m_fd, (sockaddr *) &addr, sizeof(addr)) != 0){
+        close();
+        return false;
+    }
+    set_no_delay(m_fd);
+    return true;
+}
+
+void JtagClient::close()
+{
+    if(m_fd >= 0)
+        ::close(m_fd);
+    m_fd = -1;
+}
+
+bool JtagClient::transact(const JtagServerRequest &request, const BYTE *tdi, BitSpan *tdo)
+{
+    if(m_fd < 0)
+        return false;
+    // One send, so that the request is not split in two TCP segments
+    std::vector<BYTE> msg(sizeof(request) + payload_bytes(request.nbits));
+    memcpy(msg.data(), &request, sizeof(request));
+    if(request.nbits > 0)
+        memcpy(msg.data() + sizeof(request), tdi, payload_bytes(request.nbits));
+    JtagServerResponse response;
+    if(!send_all(m_fd, msg.data(), msg.size()) || !recv_all(m_fd, &response, sizeof(response)))
+        return false;
+    if(response.nbits > 0){
+        if(tdo == NULL || response.nbits != request.nbits)
+            return false;
+        tdo->length = response.nbits;
+        if(!recv_all(m_fd, tdo->data, payload_bytes(response.nbits)))
+            return false;
+    }
+    return response.status == JTAG_STATUS_OK;
+}
+
+#else // _WIN32
+
+JtagServer::JtagServer(Transport *transport, int user1_dr_length, const TransportOptions &options)
+    : m_batch(transport, user1_dr_length, options), m_unix_fd(-1), m_tcp_fd(-1), m_tcp_port(0), m_stopping(false),
+      m_batches(0), m_requests(0)
+{
+    m_wake_fd[0] = -1;
+    m_wake_fd[1] = -1;
+}
+
+JtagServer::~JtagServer() {}
+
+bool JtagServer::listen_unix(const char *path)
+{
+    printf("JtagServer is not supported on Windows: %s\n", path);
+    return false;
+}
+
+bool JtagServer::listen_tcp(int port)
+{
+    printf("JtagServer is not supported on Windows: port %d\n", port);
+    return false;
+}
+
+void JtagServer::run() {}
+void JtagServer::stop() {}
+unsigned long long JtagServer::batches() { return 0; }
+unsigned long long JtagServer::requests() { return 0; }
+
+bool JtagClient::connect_unix(const char *) { return false; }
+bool JtagClient::connect_tcp(int) { return false; }
+void JtagClient::close() {}
+bool JtagClient::transact(const JtagServerRequest &, const BYTE *, BitSpan *) { return false; }
+
+#endif // _WIN32
+
+
+bool JtagClient::reset()
+{
+    JtagServerRequest request;
+    memset(&request, 0, sizeof(request));
+    request.op = JTAG_OP_RESET;
+    return transact(request, NULL, NULL);
+}
+
+bool JtagClient::scan_vdr(int command, int vjtag_instance_ir_width, int vjtag_instance_addr, const BitSpan &bits,
+                          bool to_read, BitSpan *tdo)
+{
+    if(bits.length <= 0 || bits.length > JTAG_SERVER_MAX_BITS)
+        return false;
+    JtagServerRequest request;
+    request.op = JTAG_OP_SCAN_VDR;
+    request.flags = (to_read)? JTAG_FLAG_READ : 0;
+    request.command = command;
+    request.ir_width = vjtag_instance_ir_width;
+    request.addr = vjtag_instance_addr;
+    request.nbits = bits.length;
+    return transact(request, bits.data, (to_read)? tdo : NULL);
+}
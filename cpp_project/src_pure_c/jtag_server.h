@@ -0,0 +1,156 @@
+#ifndef JTAG_SERVER_H
+#define JTAG_SERVER_H
+/*
+Declares JtagServer, a local daemon that owns one USB-Blaster and serves VJTAG scans to many client processes, and
+JtagClient, its client side.
+
+Only one process can open the FTDI handle. The server owns it (through any Transport, e.g. FtdiTransport or
+BlasterEmulator) and accepts requests over a Unix socket or a loopback TCP socket. Every time it wakes up, it takes all
+the complete requests of all the clients, encodes them in order into one ScanBatch (scan_batch.h), and sends it as one
+IoPipeline job, i.e. one batch of FT_Write calls. The TDO bytes of the batch are split back per request and each
+client gets the bits of its own scans. Concurrent clients therefore share the USB round trips, and the
+session cache skips the IR/VIR scans that consecutive requests have in common.
+
+Requests of one client are executed and answered in the order they were sent. Requests of different clients are not
+ordered.
+
+The client sockets are non-blocking and the responses are queued per client and sent as its socket accepts them, so a
+client that sends requests without reading the responses never blocks the loop that serves the others. While more than
+JTAG_SERVER_MAX_QUEUED response bytes wait for a client, its requests are left unread in its socket. A scan whose command or address does not fit the USER1 DR of the server (USER1DR_data_Command_valid()) is
+answered with JTAG_STATUS_BAD_REQUEST.
+
+The sockets are POSIX only. On Windows, listen_*() and connect_*() fail.
+
+Usage:
+    // server
+    JtagServer server(transport, USER1_DR_LENGTH);
+    server.listen_tcp(7300);
+    server.run();  // until server.stop()
+
+    // client
+    JtagClient client;
+    client.connect_tcp(7300);
+    client.scan_vdr(command, VJTAG_INSTANCE_IR_WIDTH, VJTAG_INSTANCE_ADDR, tdi, true, &tdo);
+*/
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ftd2xx.h"
+#include "bit_span.h"
+#include "transport.h"
+#include "scan_batch.h"
+
+// === Wire format (native byte order, both ends run on the same host) ==========
+// A request is a JtagServerRequest followed by the (nbits+7)/8 TDI bytes (packed, see bit_span.h).
+// The response is a JtagServerResponse followed by the (nbits+7)/8 TDO bytes if JTAG_FLAG_READ was set.
+#define JTAG_OP_RESET       0   // sync the tap controller to [Run_Test/Idle]; no payload
+#define JTAG_OP_SCAN_VDR    1   // JtagSession::scan_vdr
+
+#define JTAG_FLAG_READ      0x1
+
+#define JTAG_STATUS_OK          0
+#define JTAG_STATUS_IO_ERROR   -1  // the transfer failed, the state of the chain is unknown
+#define JTAG_STATUS_BAD_REQUEST -2
+
+#define JTAG_SERVER_MAX_BITS (1 << 24)
+#define JTAG_SERVER_MAX_QUEUED (4 << 20)  // bytes; more than the largest request, see JtagServer
+
+struct JtagServerRequest {
+    uint32_t op;          // JTAG_OP_*
+    uint32_t flags;       // JTAG_FLAG_*
+    int32_t command;      // the VIR command
+    int32_t ir_width;     // the VIR width of the VJTAG instance
+    int32_t addr;         // the VJTAG instance address, as for prepare_USER1DR_data_Command
+    int32_t nbits;        // the DR length, at most JTAG_SERVER_MAX_BITS
+};
+
+struct JtagServerResponse {
+    int32_t status;       // JTAG_STATUS_*
+    int32_t nbits;        // the number of TDO bits following, 0 if the request did not read
+};
+
+
+class JtagServer {
+public:
+    // The transport is not owned and must outlive the server
+    JtagServer(Transport *transport, int user1_dr_length, const TransportOptions &options = TransportOptions());
+    ~JtagServer();
+
+    // Listen for clients. Both can be used at once. A TCP port of 0 picks a free port, see tcp_port().
+    bool listen_unix(const char *path);
+    bool listen_tcp(int port);  // 127.0.0.1 only
+    int tcp_port() const { return m_tcp_port; }
+
+    // Serve the clients until stop() is called (from any thread)
+    void run();
+    void stop();
+
+    unsigned long long batches();   // the number of batches written
+    unsigned long long requests();  // the number of requests executed
+
+private:
+    struct Client {
+        int fd;
+        std::vector<BYTE> in;   // bytes received and not parsed yet
+        std::vector<BYTE> out;  // responses not sent yet, from out_pos on
+        size_t out_pos;
+        bool eof;               // no more requests are read; the client is closed once its responses are sent
+        bool closed;
+    };
+    struct Pending {
+        Client *client;
+        JtagServerRequest request;
+        int index;              // in m_batch
+    };
+
+    void accept_clients(int listen_fd);
+    void receive(Client *client);
+    void parse(Client *client, std::vector<Pending> &batch);
+    void execute(std::vector<Pending> &batch);
+    void respond(Client *client, int status, const BYTE *tdo, int nbits);
+    void flush(Client *client);
+    static size_t queued(const Client *client) { return client->out.size() - client->out_pos; }
+
+    ScanBatch m_batch;
+
+    int m_unix_fd;
+    int m_tcp_fd;
+    int m_tcp_port;
+    int m_wake_fd[2];           // stop() writes to the pipe to wake poll()
+    std::vector<Client *> m_clients;
+    std::string m_unix_path;
+
+    std::mutex m_mutex;
+    bool m_stopping;
+    unsigned long long m_batches;
+    unsigned long long m_requests;
+};
+
+
+class JtagClient {
+public:
+    JtagClient() : m_fd(-1) {}
+    ~JtagClient() { close(); }
+
+    bool connect_unix(const char *path);
+    bool connect_tcp(int port);  // 127.0.0.1
+    void close();
+
+    // Same as JtagSession::reset / JtagSession::scan_vdr, executed by the server. If `to_read`, the TDO bits are
+    // written to `tdo` (tdo->data must hold bits.num_bytes() bytes; tdo->length is set to bits.length).
+    // Returns false if the server reports an error or the connection fails.
+    bool reset();
+    bool scan_vdr(int command, int vjtag_instance_ir_width, int vjtag_instance_addr, const BitSpan &bits, bool to_read,
+                  BitSpan *tdo);
+
+private:
+    JtagClient(const JtagClient &);
+    JtagClient &operator=(const JtagClient &);
+
+    bool transact(const JtagServerRequest &request, const BYTE *tdi, BitSpan *tdo);
+
+    int m_fd;
+};
+
+#endif // JTAG_SERVER_H
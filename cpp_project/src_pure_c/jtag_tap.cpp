@@ -38,6 +38,11 @@ Ref: https://forum.sparkfun.com/viewtopic.php?t=20181&start=15
 */
 
 #import "jtag_tap.h"
+#include <string.h>
+#include "scan_cost.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define BASE  0x0C
 #define TCK   0x01
@@ -76,6 +81,14 @@ static void append_TMS1_no_data( BYTE *buf, int &cnt)
     buf[cnt++] = RDM001 | TCK ;
 }
 
+void atomic_state_trans_TMS(BYTE *buf, int &cnt, BYTE tms)
+{
+    if(tms)
+        append_TMS1_no_data(buf, cnt);
+    else
+        append_TMS0_no_data(buf, cnt);
+}
+
 // IDLE and Reset related
 void atomic_state_trans_IDL_to_IDL( BYTE *buf, int &cnt){ append_TMS0_no_data( buf, cnt); }  // [Idle] to [Idle]
 void atomic_state_trans_RST_to_RST( BYTE *buf, int &cnt){ append_TMS1_no_data( buf, cnt); }  // [Reset] to [Reset]
@@ -136,6 +149,46 @@ void atomic_state_trans_SR_to_EX1( BYTE *buf, int &cnt, BYTE bit_to_shift_in, bo
 }
 
 
+// Lookup tables for encode_SR_byte. SR_TDI_TABLE[v] holds the 16 bit-bang bytes of shifting the 8 bits of v (LSB
+// first) without reading, and SR_READ_TABLE[m] holds the READ flags to be OR'ed on top of them for the read mask m.
+// Both are built from atomic_state_trans_SR_to_SR so that the table encoder is byte-identical to the per-bit one.
+static BYTE SR_TDI_TABLE[256][16];
+static BYTE SR_READ_TABLE[256][16];
+
+static bool build_SR_tables()
+{
+    for(int v = 0; v < 256; ++v){
+        int cnt_tdi = 0, cnt_read = 0;
+        for(int i = 0; i < 8; ++i){
+            atomic_state_trans_SR_to_SR(SR_TDI_TABLE[v], cnt_tdi, (v>>i) & 0b1, false);
+            atomic_state_trans_SR_to_SR(SR_READ_TABLE[v], cnt_read, 0, (v>>i) & 0b1);
+        }
+        for(int k = 0; k < 16; ++k)
+            SR_READ_TABLE[v][k] &= READ;  // only keep the READ flag
+    }
+    return true;
+}
+
+static const bool SR_TABLES_READY = build_SR_tables();
+
+void encode_SR_byte(BYTE *buf, int &cnt, BYTE data, BYTE read_mask)
+{
+#if defined(__SSE2__)
+    __m128i tdi  = _mm_loadu_si128((const __m128i *) SR_TDI_TABLE[data]);
+    __m128i read = _mm_loadu_si128((const __m128i *) SR_READ_TABLE[read_mask]);
+    _mm_storeu_si128((__m128i *)(buf + cnt), _mm_or_si128(tdi, read));
+#else
+    unsigned long long tdi[2], read[2];
+    memcpy(tdi, SR_TDI_TABLE[data], 16);
+    memcpy(read, SR_READ_TABLE[read_mask], 16);
+    tdi[0] |= read[0];
+    tdi[1] |= read[1];
+    memcpy(buf + cnt, tdi, 16);
+#endif
+    cnt += 16;
+}
+
+
 // Common functions
 void common_functions_ANY_to_RST_to_IDL(BYTE *buf, int &cnt)
 {
@@ -147,12 +200,91 @@ void common_functions_ANY_to_RST_to_IDL(BYTE *buf, int &cnt)
     atomic_state_trans_RST_to_IDL(buf, cnt);
 }
 
-static void common_functions_shift_data(BYTE *buf, int &cnt, BYTE bits[], int length, bool to_read, bool is_ir_shift)
+static void append_ByteShift(BYTE *buf, int &cnt, const BYTE *data, int nbytes, bool to_read)
+{
+    /*
+    Send `nbytes` bytes (all 0 if `data` is NULL) in the ByteShift mode, 8 TCKs per byte with the TMS of the previous
+    BitBanging byte. A ByteShift segment never crosses a USB packet boundary (see USB_PACKET_SIZE).
+    */
+    while(nbytes > 0){
+        int n = (nbytes > BYTESHIFT_MAX_NBYTES)? BYTESHIFT_MAX_NBYTES : nbytes;
+        int packet_free = USB_PACKET_SIZE - cnt % USB_PACKET_SIZE;
+        if(packet_free < 2){
+            // No room for the initiating byte and a data byte. Fill the packet with a byte that changes nothing
+            // (TCK low, TMS 0, no read: at most a falling edge, which does not clock the tap controller).
+            buf[cnt++] = RDM000;
+            packet_free = USB_PACKET_SIZE;
+        }
+        if(n > packet_free - 1)
+            n = packet_free - 1;
+        initiate_ByteShift(buf, cnt, to_read, n);
+        if(data != NULL){
+            memcpy(buf + cnt, data, n);
+            data += n;
+        }
+        else{
+            memset(buf + cnt, 0, n);
+        }
+        cnt += n;
+        nbytes -= n;
+    }
+}
+
+static void shift_data_SR_to_EX1(BYTE *buf, int &cnt, const BitSpan &bits, bool to_read, const MaskedRead *read_mask)
+{
+    /*
+    Shift all the bits starting from [Shift_DR/IR] and end in [Exit1_DR/IR] with the last bit. The length of bits must
+    be nonzero. If `read_mask` is not NULL, it overrides `to_read` bit by bit.
+    */
+    int length = bits.length;
+    if(read_mask != NULL && read_mask->reads_all){
+        // Reading all the bits through ByteShift is cheaper than bit-banging only the masked ones (see MaskedRead)
+        to_read = true;
+        read_mask = NULL;
+    }
+    if(read_mask != NULL){
+        // A per-bit READ mask cannot be expressed in the ByteShift mode, so every bit is bit-banged. Full bytes go
+        // through the table encoder.
+        const BitSpan &mask = read_mask->mask;
+        int i = 0;
+        for(; i + 8 <= length-1; i += 8)
+            encode_SR_byte(buf, cnt, bits.data[i/8], mask.data[i/8]);
+        for(; i < length-1; ++i)
+            atomic_state_trans_SR_to_SR(buf, cnt, bits.get(i), mask.get(i));
+        atomic_state_trans_SR_to_EX1(buf, cnt, bits.get(length-1), mask.get(length-1));
+    }
+    else{
+        // Every full 8-bit run before the last bit is sent in the ByteShift mode (1 byte per 8 TCKs instead of 16).
+        // The TMS stays 0 during the ByteShift since the last BitBanging byte (the one entering Shift_DR/IR) has
+        // TMS==0. The leftover bits and the last bit (which needs TMS==1 to go to Exit1) are bit-banged. The packed
+        // bits have the same layout as the ByteShift data, so full bytes are copied as they are.
+        int i = 8 * ((length-1) / 8);
+        append_ByteShift(buf, cnt, bits.data, i / 8, to_read);
+        for(; i < length-1; ++i)
+            atomic_state_trans_SR_to_SR(buf, cnt, bits.get(i), to_read);
+        atomic_state_trans_SR_to_EX1(buf, cnt, bits.get(length-1), to_read);
+    }
+}
+
+void common_functions_SR_to_EX1(BYTE *buf, int &cnt, const BitSpan &bits, bool to_read)
+{
+    shift_data_SR_to_EX1(buf, cnt, bits, to_read, NULL);
+}
+
+void common_functions_SR_to_EX1(BYTE *buf, int &cnt, const BitSpan &bits, const MaskedRead &read_mask)
+{
+    shift_data_SR_to_EX1(buf, cnt, bits, false, &read_mask);
+}
+
+static void common_functions_shift_data(BYTE *buf, int &cnt, const BitSpan &bits, bool to_read,
+                                        const MaskedRead *read_mask, bool is_ir_shift)
 {
     /*
     The state transition to shift_IR and that to shift_DR are identical except one step. This function merges the two
     and provide a handle `is_ir_shift` to distinguish the two shifts.
 
+    If `read_mask` is not NULL, it overrides `to_read` bit by bit.
+
     The following pairs of functions have the same functionality:
     - atomic_state_trans_SIS_to_CAP / atomic_state_trans_SDS_to_CAP
     - atomic_state_trans_CAP_to_SIR / atomic_state_trans_CAP_to_SDR
@@ -166,11 +298,9 @@ static void common_functions_shift_data(BYTE *buf, int &cnt, BYTE bits[], int le
     atomic_state_trans_SIS_to_CAP(buf, cnt);
 
     // Go to the shift IR state only if the length of bits is nonzero
-    if(length > 0){
+    if(bits.length > 0){
         atomic_state_trans_CAP_to_SIR(buf, cnt);
-        for(int i = 0; i < length-1; ++i)
-            atomic_state_trans_SR_to_SR(buf, cnt, bits[i], to_read);
-        atomic_state_trans_SR_to_EX1(buf, cnt, bits[length-1], to_read);
+        shift_data_SR_to_EX1(buf, cnt, bits, to_read, read_mask);
     }
     else{
         atomic_state_trans_CAP_to_EX1(buf, cnt);
@@ -181,22 +311,205 @@ static void common_functions_shift_data(BYTE *buf, int &cnt, BYTE bits[], int le
     atomic_state_trans_UPD_to_IDL(buf, cnt);
 }
 
-void common_functions_IDL_to_SIR_to_IDL(BYTE *buf, int &cnt, BYTE bits[], int length, bool to_read)
+void common_functions_IDL_to_SIR_to_IDL(BYTE *buf, int &cnt, const BitSpan &bits, bool to_read)
+{
+    return common_functions_shift_data(buf, cnt, bits, to_read, NULL, true);
+}
+
+void common_functions_IDL_to_SDR_to_IDL(BYTE *buf, int &cnt, const BitSpan &bits, bool to_read)
 {
-    return common_functions_shift_data(buf, cnt, bits, length, to_read, true);
+    return common_functions_shift_data(buf, cnt, bits, to_read, NULL, false);
 }
 
-void common_functions_IDL_to_SDR_to_IDL(BYTE *buf, int &cnt, BYTE bits[], int length, bool to_read)
+void common_functions_IDL_to_SIR_to_IDL(BYTE *buf, int &cnt, const BitSpan &bits, const MaskedRead &read_mask)
 {
-    return common_functions_shift_data(buf, cnt, bits, length, to_read, false);
+    return common_functions_shift_data(buf, cnt, bits, false, &read_mask, true);
+}
+
+void common_functions_IDL_to_SDR_to_IDL(BYTE *buf, int &cnt, const BitSpan &bits, const MaskedRead &read_mask)
+{
+    return common_functions_shift_data(buf, cnt, bits, false, &read_mask, false);
+}
+
+void idle_clocks(BYTE *buf, int &cnt, int n)
+{
+    // The BitBanging byte before holds TMS==0 (every transition into [Run_Test/Idle] or [Pause_DR/IR] has TMS==0), and
+    // TDI does not matter outside the Shift states
+    if(n <= 0)
+        return;
+    append_ByteShift(buf, cnt, NULL, n / 8, false);
+    for(int i = 0; i < n % 8; ++i)
+        atomic_state_trans_IDL_to_IDL(buf, cnt);
+}
+
+void idle_clocks(CommandBuffer &buf, int n)
+{
+    buf.reserve(max_idle_bytes(n));
+    idle_clocks(buf.data(), buf.cnt(), n);
+    buf.check();
+}
+
+int max_scan_bytes(int length)
+{
+    return 2 * length + 2 * SCAN_MAX_TMS_CLOCKS;
+}
+
+int max_idle_bytes(int n)
+{
+    // 1 byte per 8 clocks, at most 2 initiating/padding bytes per ByteShift segment (one per 31 bytes is plenty) and
+    // 2 bytes per leftover clock
+    return (n > 0)? n / 8 + n / 64 + 32 : 0;
+}
+
+void common_functions_ANY_to_RST_to_IDL(CommandBuffer &buf)
+{
+    buf.reserve(max_scan_bytes(0));
+    common_functions_ANY_to_RST_to_IDL(buf.data(), buf.cnt());
+    buf.check();
+}
+
+void common_functions_IDL_to_SIR_to_IDL(CommandBuffer &buf, const BitSpan &bits, bool to_read)
+{
+    buf.reserve(max_scan_bytes(bits.length));
+    common_functions_shift_data(buf.data(), buf.cnt(), bits, to_read, NULL, true);
+    buf.check();
+}
+
+void common_functions_IDL_to_SDR_to_IDL(CommandBuffer &buf, const BitSpan &bits, bool to_read)
+{
+    buf.reserve(max_scan_bytes(bits.length));
+    common_functions_shift_data(buf.data(), buf.cnt(), bits, to_read, NULL, false);
+    buf.check();
+}
+
+void common_functions_IDL_to_SIR_to_IDL(CommandBuffer &buf, const BitSpan &bits, const MaskedRead &read_mask)
+{
+    buf.reserve(max_scan_bytes(bits.length));
+    common_functions_shift_data(buf.data(), buf.cnt(), bits, false, &read_mask, true);
+    buf.check();
+}
+
+void common_functions_IDL_to_SDR_to_IDL(CommandBuffer &buf, const BitSpan &bits, const MaskedRead &read_mask)
+{
+    buf.reserve(max_scan_bytes(bits.length));
+    common_functions_shift_data(buf.data(), buf.cnt(), bits, false, &read_mask, false);
+    buf.check();
+}
+
+void common_functions_SR_to_EX1(CommandBuffer &buf, const BitSpan &bits, bool to_read)
+{
+    buf.reserve(max_scan_bytes(bits.length));
+    shift_data_SR_to_EX1(buf.data(), buf.cnt(), bits, to_read, NULL);
+    buf.check();
+}
+
+void common_functions_SR_to_EX1(CommandBuffer &buf, const BitSpan &bits, const MaskedRead &read_mask)
+{
+    buf.reserve(max_scan_bytes(bits.length));
+    shift_data_SR_to_EX1(buf.data(), buf.cnt(), bits, false, &read_mask);
+    buf.check();
+}
+
+
+int TDO_byte_count(int length)
+{
+    if(length <= 0)
+        return 0;
+    return (length-1) / 8 + (length-1) % 8 + 1;
+}
+
+MaskedRead::MaskedRead(const BitSpan &mask, const CostParams &params)
+    : mask(mask), nread(read_mask_count(mask)), reads_all(masked_shift_reads_all(mask.length, nread, params))
+{
+}
+
+int TDO_byte_count(const MaskedRead &read_mask)
+{
+    return read_mask.reads_all? TDO_byte_count(read_mask.mask.length) : read_mask.nread;
+}
+
+bool extract_TDO_bits(const BYTE *read_buf, int &read_cnt, BitSpan &bits)
+{
+    /*
+    The layout mirrors common_functions_shift_data: one byte per ByteShift byte (8 TDO bits, LSB first, which is
+    already the packed layout), then one byte per bit-banged bit (TDO in bit 0).
+    */
+    int length = bits.length;
+    if(length <= 0)
+        return false;
+    int nbytes = (length-1) / 8;
+    memcpy(bits.data, read_buf + read_cnt, nbytes);
+    read_cnt += nbytes;
+    for(int i = 8*nbytes; i < length; ++i)
+        bits.set(i, read_buf[read_cnt++]);
+    return true;
+}
+
+bool extract_TDO_bits(const BYTE *read_buf, int &read_cnt, BitSpan &bits, const MaskedRead &read_mask)
+{
+    /*
+    A masked shift is either fully bit-banged, with one byte (TDO in bit 0) per bit set in the read mask, or read as a
+    whole (see shift_data_SR_to_EX1), in which case the mask is applied to the bytes of the unmasked layout in place.
+    */
+    const BitSpan &mask = read_mask.mask;
+    int length = bits.length;
+    if(length <= 0)
+        return false;
+    if(read_mask.reads_all){
+        int nbytes = (length-1) / 8;
+        for(int i = 0; i < nbytes; ++i){
+            BYTE m = mask.data[i];
+            bits.data[i] = (bits.data[i] & ~m) | (read_buf[read_cnt++] & m);
+        }
+        for(int i = 8*nbytes; i < length; ++i, ++read_cnt){
+            if(mask.get(i))
+                bits.set(i, read_buf[read_cnt]);
+        }
+        return true;
+    }
+    for(int i = 0; i < length; ++i){
+        if(mask.get(i))
+            bits.set(i, read_buf[read_cnt++]);
+    }
+    return true;
 }
 
 
 bool initiate_ByteShift(BYTE *buf, int &cnt, bool to_read, unsigned nbytes){
-    if(nbytes > 0x3F){
+    if(nbytes > BYTESHIFT_MAX_NBYTES){
         return false;
     }
     BYTE base = (SHIFT) | (to_read? READ:0) | (nbytes & 0x3F);
     buf[cnt++] = base;
     return true;
 }
+
+
+int TdoCounter::count(const BYTE *buf, int nbytes, int max_tdo, int &consumed)
+{
+    int tdo = 0;
+    int i = 0;
+    for(; i < nbytes; ++i){
+        BYTE b = buf[i];
+        int produced;
+        if(shift_remaining > 0)
+            produced = shift_read? 1 : 0;
+        else if(b & SHIFT)
+            produced = 0;
+        else
+            produced = (b & READ)? 1 : 0;
+        if(tdo + produced > max_tdo)
+            break;
+        tdo += produced;
+
+        if(shift_remaining > 0){
+            --shift_remaining;
+        }
+        else if(b & SHIFT){
+            shift_remaining = b & BYTESHIFT_MAX_NBYTES;
+            shift_read = (b & READ) != 0;
+        }
+    }
+    consumed = i;
+    return tdo;
+}
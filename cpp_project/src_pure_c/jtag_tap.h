@@ -12,10 +12,20 @@ For more information about the JTAG transitioning, look up:
 
 */
 #include "ftd2xx.h"
+#include "bit_span.h"
+#include "command_buffer.h"
+#include "scan_cost.h"
 
 void atomic_state_trans_SR_to_SR  (BYTE *buf, int &cnt, BYTE bit_to_shift_in, bool to_read);  // change state from [Shift_DR/IR] to [Shift_DR/IR], i.e. shift one bit
 void atomic_state_trans_SR_to_EX1 (BYTE *buf, int &cnt, BYTE bit_to_shift_in, bool to_read);  // change state from [Shift_DR/IR] to [Exit1_DR/IR]
 
+// Shift 8 bits (packed in `data`, LSB first) in [Shift_DR/IR] and read the TDO of the bits set in `read_mask`. This
+// appends the same 16 bytes as 8 calls of atomic_state_trans_SR_to_SR, but through lookup tables (and SSE2 if
+// available) instead of branching on every bit.
+void encode_SR_byte(BYTE *buf, int &cnt, BYTE data, BYTE read_mask);
+
+void atomic_state_trans_TMS(BYTE *buf, int &cnt, BYTE tms);  // clock the tap controller once with TMS==tms, no data
+
 
 // IDLE and Reset related
 void atomic_state_trans_IDL_to_IDL(BYTE *buf, int &cnt);  // change state from [Run_Test/Idle] to [Run_Test/Idle]
@@ -45,12 +55,88 @@ void atomic_state_trans_CAP_to_SIR(BYTE *buf, int &cnt);  // change state from [
 void atomic_state_trans_EX2_to_SIR(BYTE *buf, int &cnt);  // change state from [Exit2_IR] to [Shift_IR]
 
 
+// The encoding of a shift that only reads the TDO of the bits set in `mask`. ByteShift can only read all or none of the
+// bits, so the shift is either bit-banged with encode_SR_byte, reading only the masked bits, or a ByteShift read of all
+// the bits with the mask applied when extracting, whichever the cost model predicts cheaper (masked_shift_reads_all,
+// scan_cost.h). The choice is made once here, and the encoder, TDO_byte_count and extract_TDO_bits follow it, so the
+// same MaskedRead (or a BitSpan, converted with the default CostParams) has to be given to all three.
+// With the default CostParams, ByteShift wins for every shift longer than 8 bits. The bit-banged encoding pays off when
+// the TDO bytes cost much more than the written ones (e.g. a read_byte_ns of 10x write_byte_ns, for a link whose reads
+// are bound by their round trips) and the mask is sparse.
+struct MaskedRead {
+    MaskedRead(const BitSpan &mask, const CostParams &params = CostParams());
+
+    BitSpan mask;
+    int nread;       // the number of bits set in the mask
+    bool reads_all;  // read all the bits through ByteShift
+};
+
 // Common functions
+// The IR/DR shifts automatically use the ByteShift mode for every full 8-bit run and bit-bang only the leftover bits
+// and the last bit (TMS==1). The bits are packed, LSB (first shifted) first; see bit_span.h. When `to_read` is true,
+// the TDO bytes come back in the same layout; use TDO_byte_count() and extract_TDO_bits() to decode them.
 void common_functions_ANY_to_RST_to_IDL(BYTE *buf, int &cnt);
-void common_functions_IDL_to_SIR_to_IDL(BYTE *buf, int &cnt, BYTE bits[], int length, bool to_read);
-void common_functions_IDL_to_SDR_to_IDL(BYTE *buf, int &cnt, BYTE bits[], int length, bool to_read);
+void common_functions_IDL_to_SIR_to_IDL(BYTE *buf, int &cnt, const BitSpan &bits, bool to_read);
+void common_functions_IDL_to_SDR_to_IDL(BYTE *buf, int &cnt, const BitSpan &bits, bool to_read);
+// Same as above but only read the TDO of the bits set in `read_mask` (same length as `bits`), see MaskedRead.
+void common_functions_IDL_to_SIR_to_IDL(BYTE *buf, int &cnt, const BitSpan &bits, const MaskedRead &read_mask);
+void common_functions_IDL_to_SDR_to_IDL(BYTE *buf, int &cnt, const BitSpan &bits, const MaskedRead &read_mask);
+// Only the shifting part of the above: from [Shift_DR/IR], shift all the bits (at least one) and end in [Exit1_DR/IR].
+void common_functions_SR_to_EX1(BYTE *buf, int &cnt, const BitSpan &bits, bool to_read);
+void common_functions_SR_to_EX1(BYTE *buf, int &cnt, const BitSpan &bits, const MaskedRead &read_mask);
+
+// The same on a CommandBuffer: the worst case of the whole shift (max_scan_bytes()) is reserved once, then the bytes are
+// encoded without checks.
+void common_functions_ANY_to_RST_to_IDL(CommandBuffer &buf);
+void common_functions_IDL_to_SIR_to_IDL(CommandBuffer &buf, const BitSpan &bits, bool to_read);
+void common_functions_IDL_to_SDR_to_IDL(CommandBuffer &buf, const BitSpan &bits, bool to_read);
+void common_functions_IDL_to_SIR_to_IDL(CommandBuffer &buf, const BitSpan &bits, const MaskedRead &read_mask);
+void common_functions_IDL_to_SDR_to_IDL(CommandBuffer &buf, const BitSpan &bits, const MaskedRead &read_mask);
+void common_functions_SR_to_EX1(CommandBuffer &buf, const BitSpan &bits, bool to_read);
+void common_functions_SR_to_EX1(CommandBuffer &buf, const BitSpan &bits, const MaskedRead &read_mask);
+
+// Clock the tap controller `n` times with TMS==0, i.e. wait `n` TCKs in [Run_Test/Idle] (or [Pause_DR/IR]). The tap
+// controller must already be there. Every 8 clocks take 1 byte in the ByteShift mode instead of 16 BitBanging bytes.
+void idle_clocks(BYTE *buf, int &cnt, int n);
+void idle_clocks(CommandBuffer &buf, int n);
+
+// The TCKs with no data a scan may take around its shift: a reset from an unknown state and the TMS paths to
+// [Shift_DR/IR] and from [Exit1_DR/IR] (see JtagTap)
+#define SCAN_MAX_TMS_CLOCKS 32
+// An upper bound of the bytes a scan of `length` bits appends: 2 bytes per bit-banged bit (ByteShift needs less, its
+// initiating and padding bytes included) and 2 bytes per TMS clock
+int max_scan_bytes(int length);
+// An upper bound of the bytes idle_clocks(n) appends
+int max_idle_bytes(int n);
+
+// Number of TDO bytes produced by a read shift of `length` bits through the common functions above.
+int TDO_byte_count(int length);
+int TDO_byte_count(const MaskedRead &read_mask);  // for the masked shifts
+
+/*
+This function converts the TDO bytes of a read shift (done by the common functions above) back to packed bits.
+
+Args:
+    read_buf: the bytes read from the device.
+    read_cnt: the index of read_buf where the TDO bytes of this shift begin. It is advanced past them.
+    bits: the output packed bits. bits.length is the number of bits of the shift and bits.data must hold
+          bits.num_bytes() bytes.
+
+Returns:
+    true if the bits are extracted, false otherwise.
+*/
+bool extract_TDO_bits(const BYTE *read_buf, int &read_cnt, BitSpan &bits);
+// For the masked shifts. Only the bits set in `read_mask` are written.
+bool extract_TDO_bits(const BYTE *read_buf, int &read_cnt, BitSpan &bits, const MaskedRead &read_mask);
 
 // Byte Shift operation
+#define BYTESHIFT_MAX_NBYTES 0x3F  // the number of bytes in one ByteShift is stored in the 6 LSBs of the initiating byte
+
+// The USB-Blaster is a full speed device with 64-byte bulk packets. The common functions keep every ByteShift
+// initiating byte in the same packet as its data, assuming the buffer (index 0) starts a packet. The writes of a buffer
+// therefore have to start at multiples of USB_PACKET_SIZE (see TransportOptions::write_chunk).
+#define USB_PACKET_SIZE 64
+
 /*
 This function adds a functional byte to the buffer indicate the beginning of the ByteShift mode.
 
@@ -65,4 +151,32 @@ Returns:
 */
 bool initiate_ByteShift(BYTE *buf, int &cnt, bool to_read, unsigned nbytes);
 
+
+// Counting the TDO bytes of an already prepared buffer
+/*
+Walks a prepared byte buffer and counts the TDO bytes it will produce, one chunk at a time. A ByteShift run may span
+two chunks, so the counter keeps the ByteShift state between the calls. Start a new counter for every buffer.
+*/
+struct TdoCounter {
+    TdoCounter() : shift_remaining(0), shift_read(false) {}
+
+    /*
+    Count the TDO bytes of the first bytes of `buf`, stopping before the byte that would make the count exceed
+    `max_tdo`.
+
+    Args:
+        buf: the prepared bytes.
+        nbytes: the number of bytes available in buf.
+        max_tdo: the largest count allowed.
+        consumed: the number of bytes counted, at most nbytes.
+
+    Returns:
+        the number of TDO bytes produced by the `consumed` bytes.
+    */
+    int count(const BYTE *buf, int nbytes, int max_tdo, int &consumed);
+
+    int shift_remaining;  // ByteShift data bytes left in the current run
+    bool shift_read;      // the current run reads the TDO's
+};
+
 #endif
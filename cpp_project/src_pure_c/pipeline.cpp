@@ -0,0 +1,248 @@
+/*
+This file implements the IoPipeline writer and reader threads.
+*/
+#include <limits.h>
+#include "pipeline.h"
+#include "jtag_tap.h"
+
+IoPipeline::IoPipeline(Transport *transport, const TransportOptions &options)
+    : m_transport(transport), m_read_timeout_ms(options.stall_timeout_ms),
+      m_write_chunk(options.write_chunk / USB_PACKET_SIZE * USB_PACKET_SIZE),
+      m_max_outstanding_read(options.max_outstanding_read),
+      m_in_flight(0), m_stopping(false), m_writer_done(false), m_purge(false), m_reading(NULL), m_writing(NULL),
+      m_released(0), m_read_total(0)
+{
+    if(m_write_chunk < USB_PACKET_SIZE)
+        m_write_chunk = USB_PACKET_SIZE;
+    if(m_max_outstanding_read < USB_PACKET_SIZE)
+        m_max_outstanding_read = USB_PACKET_SIZE;
+    m_writer = std::thread(&IoPipeline::writer_loop, this);
+    m_reader = std::thread(&IoPipeline::reader_loop, this);
+}
+
+IoPipeline::~IoPipeline()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cv.notify_all();
+    m_writer.join();
+
+    // The reader stops only after the writer has handed over its last job
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_writer_done = true;
+    }
+    m_cv.notify_all();
+    m_reader.join();
+}
+
+void IoPipeline::submit(IoJob *job)
+{
+    job->ok = false;
+    job->read_buf.clear();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_to_write.push_back(job);
+        ++m_in_flight;
+    }
+    m_cv.notify_all();
+}
+
+IoJob *IoPipeline::wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this]{ return !m_completed.empty() || m_in_flight == 0; });
+    if(m_completed.empty())
+        return NULL;
+    IoJob *job = m_completed.front();
+    m_completed.pop_front();
+    --m_in_flight;
+    return job;
+}
+
+int IoPipeline::in_flight()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_in_flight;
+}
+
+IoStats IoPipeline::stats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void IoPipeline::writer_loop()
+{
+    for(;;){
+        IoJob *job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]{ return !m_to_write.empty() || m_stopping; });
+            if(m_to_write.empty())
+                return;  // stopping and nothing left to write
+            job = m_to_write.front();
+            m_to_write.pop_front();
+            m_writing = job;
+        }
+
+        // After a failure, drop the TDO bytes the failed jobs may still produce once the reader is done with them
+        bool purge;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            purge = m_purge;
+            if(purge)
+                m_cv.wait(lock, [this]{ return m_to_read.empty() && m_reading == NULL; });
+        }
+        if(purge){
+            m_transport->purge();
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_read_total = m_released;
+            m_purge = false;
+        }
+
+        // The flow control relies on the TDO bytes counted from the buffer, so they have to agree with the job
+        const BYTE *buf = job->write_buf.data();
+        int size = (int) job->write_buf.size();
+        TdoCounter total_counter;
+        int consumed = 0;
+        bool ok = (total_counter.count(buf, size, INT_MAX, consumed) == (int) job->expected_read);
+
+        // Hand the job to the reader right away, so it drains the TDO bytes while the job is still being written
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            job->ok = ok;
+            m_to_read.push_back(job);
+        }
+        m_cv.notify_all();
+
+        // Write in chunks, each one small enough to keep the TDO bytes not yet read under m_max_outstanding_read.
+        // Otherwise, a read-heavy buffer fills the device FIFO, the device stops consuming the written bytes, and the
+        // write never finishes. The TDO bytes of a chunk are released to the reader before the chunk is written, so
+        // the reader drains them while the write is in progress.
+        // Every chunk but the last one is a whole number of USB packets. Waiting for a budget of at least one packet
+        // guarantees that (a packet produces at most USB_PACKET_SIZE TDO bytes).
+        TdoCounter counter;
+        int pos = 0;
+        while(ok && pos < size){
+            int budget;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this, job]{
+                    return m_released - m_read_total + USB_PACKET_SIZE <= m_max_outstanding_read || !job->ok ||
+                           m_purge;
+                });
+                // The reader gave up this job, or an earlier one whose bytes may now be taken for this one's
+                if(!job->ok || m_purge){
+                    job->ok = false;
+                    ok = false;
+                    break;
+                }
+                budget = (int)(m_max_outstanding_read - (m_released - m_read_total));
+            }
+            int n = (size - pos < (int) m_write_chunk)? size - pos : (int) m_write_chunk;
+            TdoCounter chunk_counter = counter;
+            int tdo = chunk_counter.count(buf + pos, n, budget, consumed);
+            if(pos + consumed < size && consumed % USB_PACKET_SIZE != 0){
+                // Cut at the last packet boundary and count again
+                consumed = consumed / USB_PACKET_SIZE * USB_PACKET_SIZE;
+                chunk_counter = counter;
+                tdo = chunk_counter.count(buf + pos, consumed, budget, consumed);
+            }
+            counter = chunk_counter;
+            if(tdo > 0){
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_released += tdo;
+            }
+            m_cv.notify_all();
+
+            DWORD written = 0;
+            ok = m_transport->write(buf + pos, (DWORD) consumed, written) && written == (DWORD) consumed;
+            pos += consumed;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stats.bytes_written += written;
+                if(!ok)
+                    job->ok = false;  // the reader gives up the TDO bytes that will never come
+            }
+            m_cv.notify_all();
+        }
+
+        // The job may complete now: its last bytes (e.g. the transitions after the last TDO bit) are out
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_writing = NULL;
+        }
+        m_cv.notify_all();
+    }
+}
+
+void IoPipeline::reader_loop()
+{
+    for(;;){
+        IoJob *job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]{ return !m_to_read.empty() || m_writer_done; });
+            if(m_to_read.empty())
+                return;
+            job = m_to_read.front();
+            m_to_read.pop_front();
+            m_reading = job;
+            if(m_purge)
+                job->ok = false;  // written behind a failed job, its bytes cannot be told apart
+        }
+
+        // Drain the TDO bytes of this job as soon as the bytes producing them are written
+        job->read_buf.resize(job->expected_read);
+        DWORD got = 0;
+        while(got < job->expected_read){
+            DWORD n;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this, job]{ return m_released > m_read_total || !job->ok; });
+                if(!job->ok){
+                    m_read_total = m_released;  // give up the bytes of the failed job
+                    break;
+                }
+                n = (DWORD)(m_released - m_read_total);
+            }
+            if(n > job->expected_read - got)
+                n = job->expected_read - got;
+
+            DWORD nread = 0;
+            bool ok = m_transport->read_exact(job->read_buf.data() + got, n, nread, m_read_timeout_ms);
+            got += nread;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_read_total += nread;
+                m_stats.bytes_read += nread;
+                if(!ok){
+                    job->ok = false;
+                    m_read_total = m_released;
+                }
+            }
+            m_cv.notify_all();
+            if(!ok)
+                break;
+        }
+        job->read_buf.resize(got);
+
+        {
+            // A job that reads nothing, or whose TDO bytes come before its last written bytes, is still being written.
+            // Completing it now would hand write_buf back to the caller while the writer sends from it.
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this, job]{ return m_writing != job; });
+            ++m_stats.jobs_completed;
+            if(!job->ok){
+                ++m_stats.jobs_failed;
+                m_purge = true;
+            }
+            m_reading = NULL;
+            m_completed.push_back(job);
+        }
+        m_cv.notify_all();
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef IO_PIPELINE_H
+#define IO_PIPELINE_H
+/*
+Declares IoPipeline, which overlaps the encoding of the byte buffers with their USB transfer.
+
+Without the pipeline, the caller encodes the whole buffer, writes it and then blocks in the read, so the CPU and the
+USB are never busy at the same time. With the pipeline, a writer thread streams the submitted buffers to the device
+while the caller encodes the next one, and a reader thread drains the TDO bytes of the buffers already written.
+
+Usage (double buffering):
+    IoJob jobs[2];
+    for(...){
+        IoJob *job = (first two rounds)? &jobs[i] : pipeline.wait();  // recycle a completed job
+        ... encode into job->write_buf, set job->expected_read ...
+        pipeline.submit(job);
+    }
+    ... pipeline.wait() for the jobs still in flight ...
+
+The jobs complete in the order they were submitted, once all their bytes are written and all their TDO bytes read.
+
+Framing: the buffers are written in chunks of TransportOptions::write_chunk bytes, always cut at USB packet
+boundaries so that the ByteShift segments prepared by jtag_tap.h stay within one packet.
+
+Flow control: the USB-Blaster stops consuming the written bytes once its output FIFO (and the driver's buffer behind
+it) is full of TDO bytes nobody has read. A read-heavy buffer written in one piece would then never finish. The
+writer therefore counts the TDO bytes of every chunk (TdoCounter, jtag_tap.h), keeps the bytes expected but not yet
+read under TransportOptions::max_outstanding_read (by default the ftd2xx USB transfer size, so the driver can always
+absorb them), and the reader drains them as soon as the chunk producing them is written.
+
+Failure: once a job fails (a write error, or read_exact timing out on a stalled device), the writer stops writing it at
+the next chunk, and the job being written behind it fails as well. Before the next job is written, the writer waits for
+the reader to finish the failed jobs and purges the receive side (Transport::purge()), so the TDO bytes of the failed
+jobs arriving late are not read as the bytes of the next job.
+*/
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ftd2xx.h"
+#include "transport.h"
+
+struct IoJob {
+    IoJob() : expected_read(0), ok(false) {}
+
+    std::vector<BYTE> write_buf;  // the encoded bytes to write
+    DWORD expected_read;          // the number of TDO bytes the write_buf produces (JtagTap::expected_read)
+    std::vector<BYTE> read_buf;   // the TDO bytes, filled by the pipeline
+    bool ok;                      // false if the write or the read failed
+};
+
+// Counters of an IoPipeline since it was created
+struct IoStats {
+    IoStats() : jobs_completed(0), jobs_failed(0), bytes_written(0), bytes_read(0) {}
+
+    unsigned long long jobs_completed;  // including the failed ones
+    unsigned long long jobs_failed;
+    unsigned long long bytes_written;
+    unsigned long long bytes_read;      // TDO bytes
+};
+
+class IoPipeline {
+public:
+    // The transport is not owned and must outlive the pipeline. Exactly `expected_read` bytes are read for every job
+    // (Transport::read_exact); a device that makes no progress for `options.stall_timeout_ms` fails the job. A job
+    // whose expected_read does not match the TDO bytes counted from its write_buf fails without being written.
+    explicit IoPipeline(Transport *transport, const TransportOptions &options = TransportOptions());
+    ~IoPipeline();  // finishes the jobs in flight before returning
+
+    // Queue a job. The pipeline owns the job until wait() returns it.
+    void submit(IoJob *job);
+
+    // Block until the next job (in submission order) completes and return it, or NULL if no job is in flight.
+    IoJob *wait();
+
+    int in_flight();
+
+    // A snapshot of the counters, safe to call from any thread
+    IoStats stats();
+
+private:
+    void writer_loop();
+    void reader_loop();
+
+    Transport *m_transport;
+    int m_read_timeout_ms;
+    DWORD m_write_chunk;
+    DWORD m_max_outstanding_read;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<IoJob *> m_to_write;
+    std::deque<IoJob *> m_to_read;
+    std::deque<IoJob *> m_completed;
+    int m_in_flight;
+    bool m_stopping;
+    bool m_writer_done;
+    bool m_purge;                     // a job failed; purge before writing the next one
+    IoJob *m_reading;                 // the job the reader is draining, NULL if none
+    IoJob *m_writing;                 // the job the writer is sending, NULL if none
+    unsigned long long m_released;    // TDO bytes produced by the bytes written so far
+    unsigned long long m_read_total;  // TDO bytes read so far
+    IoStats m_stats;
+
+    std::thread m_writer;
+    std::thread m_reader;
+};
+
+#endif // IO_PIPELINE_H
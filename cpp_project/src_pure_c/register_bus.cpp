@@ -0,0 +1,97 @@
+/*
+This file implements RegisterBus and the DR3 transaction encoding.
+*/
+#include <stdio.h>
+#include "register_bus.h"
+
+bool prepare_DR3_data(BitSpan &bits, uint32_t addr, bool write, const uint32_t *words, int count)
+{
+    if(count < 0 || count > DR3_MAX_WORDS)
+        return false;
+    bits.length = DR3_HEADER_LENGTH + 32 * count;
+    bits.clear();
+    for(int i = 0; i < 32; ++i)
+        bits.set(i, (addr >> i) & 0b1);
+    bits.set(32, write);
+    if(words == NULL)
+        return true;
+
+    // Whole words from bit 33 on
+    for(int w = 0; w < count; ++w){
+        for(int i = 0; i < 32; ++i)
+            bits.set(DR3_HEADER_LENGTH + 32 * w + i, (words[w] >> i) & 0b1);
+    }
+    return true;
+}
+
+
+RegisterBus::RegisterBus(Transport *transport, const VjtagTarget &target, const TransportOptions &options)
+    : m_batch(transport, target.user1_dr_length(), options), m_target(target)
+{
+}
+
+BitSpan RegisterBus::prepare(uint32_t addr, bool write, const uint32_t *words, int count)
+{
+    BitSpan bits;
+    if(count < 1){
+        printf("A register transaction needs at least one word.\n");
+        return bits;
+    }
+    m_tdi.resize((DR3_HEADER_LENGTH + 32 * (size_t) count + 7) / 8);
+    bits.data = m_tdi.data();
+    if(!prepare_DR3_data(bits, addr, write, words, count)){
+        printf("Too many words (%d) for one register transaction.\n", count);
+        bits.length = 0;
+    }
+    return bits;
+}
+
+std::future<BatchResult> RegisterBus::queue_read(uint32_t addr, int count)
+{
+    BitSpan bits = prepare(addr, false, NULL, count);
+    if(bits.length == 0){
+        std::promise<BatchResult> failed;
+        failed.set_value(BatchResult());
+        return failed.get_future();
+    }
+    return m_batch.exchange(m_target, VJTAG_CMD_REGISTERS, bits);
+}
+
+std::future<BatchResult> RegisterBus::queue_write(uint32_t addr, const uint32_t *words, int count)
+{
+    BitSpan bits = prepare(addr, true, words, count);
+    if(bits.length == 0){
+        std::promise<BatchResult> failed;
+        failed.set_value(BatchResult());
+        return failed.get_future();
+    }
+    return m_batch.write(m_target, VJTAG_CMD_REGISTERS, bits);
+}
+
+bool RegisterBus::decode_read(const BatchResult &result, uint32_t *words, int count)
+{
+    if(!result.ok || result.length < DR3_HEADER_LENGTH + 32 * count)
+        return false;
+    BitSpan bits(const_cast<BYTE *>(result.data.data()), result.length);
+    for(int w = 0; w < count; ++w){
+        uint32_t word = 0;
+        for(int i = 0; i < 32; ++i)
+            word |= (uint32_t) bits.get(DR3_HEADER_LENGTH + 32 * w + i) << i;
+        words[w] = word;
+    }
+    return true;
+}
+
+bool RegisterBus::read(uint32_t addr, uint32_t *words, int count)
+{
+    std::future<BatchResult> result = queue_read(addr, count);
+    submit();
+    return decode_read(result.get(), words, count);
+}
+
+bool RegisterBus::write(uint32_t addr, const uint32_t *words, int count)
+{
+    std::future<BatchResult> result = queue_write(addr, words, count);
+    submit();
+    return result.get().ok;
+}
@@ -0,0 +1,63 @@
+#ifndef JTAG_REGISTER_BUS_H
+#define JTAG_REGISTER_BUS_H
+/*
+Declares RegisterBus, 32-bit memory-mapped register access to vJTAG_interface.v through its DR3 (VIR command 3,
+VJTAG_CMD_REGISTERS) instead of the 8-bit DR1/DR2.
+
+A transaction is one USER0 DR scan: 32 address bits, 1 write bit, then the 32-bit data words of consecutive addresses
+(address, address + 4, ...), all LSB first. For a read, the FPGA shifts every word out while the next one shifts in,
+so the TDO bits of word k start at DR3_HEADER_LENGTH + 32 * k. A burst of n words thus costs one header and one VIR
+check instead of n of each, and a batch of transactions on the same instance never reloads the VIR.
+
+The calls run through a Batch (batch.h): read32/write32/read/write run their transaction in its own round trip, and the
+queue_*() variants only queue it, so that many transactions share the round trip of submit().
+
+Usage:
+    RegisterBus regs(transport, hub.target(*node));
+    uint32_t id;
+    regs.read32(DR3_ID_ADDR, id);
+    regs.write(DR3_SCRATCH_ADDR, words, 16);
+*/
+#include <stdint.h>
+#include <future>
+#include <vector>
+#include "ftd2xx.h"
+#include "bit_span.h"
+#include "transport.h"
+#include "ir_dr_util.h"
+#include "batch.h"
+
+#define DR3_MAX_WORDS (1 << 24)  // per transaction
+
+// Fill `bits` with a DR3 transaction of `count` words. `words` may be NULL for a read (the data shifted in is 0).
+// The caller provides (DR3_HEADER_LENGTH + 32 * count + 7) / 8 bytes in bits.data.
+bool prepare_DR3_data(BitSpan &bits, uint32_t addr, bool write, const uint32_t *words, int count);
+
+class RegisterBus {
+public:
+    // The transport is not owned and must outlive the bus
+    RegisterBus(Transport *transport, const VjtagTarget &target, const TransportOptions &options = TransportOptions());
+
+    bool read32(uint32_t addr, uint32_t &value) { return read(addr, &value, 1); }
+    bool write32(uint32_t addr, uint32_t value) { return write(addr, &value, 1); }
+    // Bursts of `count` words at addr, addr + 4, ...
+    bool read(uint32_t addr, uint32_t *words, int count);
+    bool write(uint32_t addr, const uint32_t *words, int count);
+
+    // Queue the transaction without running it. decode_read() takes the words out of the result of a queued read.
+    std::future<BatchResult> queue_read(uint32_t addr, int count);
+    std::future<BatchResult> queue_write(uint32_t addr, const uint32_t *words, int count);
+    static bool decode_read(const BatchResult &result, uint32_t *words, int count);
+    bool submit() { return m_batch.submit(); }
+
+    Batch &batch() { return m_batch; }
+
+private:
+    BitSpan prepare(uint32_t addr, bool write, const uint32_t *words, int count);
+
+    Batch m_batch;
+    VjtagTarget m_target;
+    std::vector<BYTE> m_tdi;  // the transaction being queued
+};
+
+#endif // JTAG_REGISTER_BUS_H
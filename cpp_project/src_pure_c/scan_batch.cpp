@@ -0,0 +1,107 @@
+/*
+This file implements ScanBatch.
+*/
+#include "scan_batch.h"
+#include "jtag_tap.h"
+#include "ir_dr_util.h"
+
+ScanBatch::ScanBatch(Transport *transport, int user1_dr_length, const TransportOptions &options)
+    : m_pipeline(transport, options), m_session(user1_dr_length), m_buffer(NULL), m_sent_bytes(0), m_need_reset(true)
+{
+}
+
+ScanBatch::~ScanBatch()
+{
+    m_session.buffers().release(m_buffer);
+}
+
+void ScanBatch::clear()
+{
+    // The session cached the IR/VIR of the discarded scans as if they had been sent
+    if(pending()){
+        m_session.invalidate();
+        m_need_reset = true;
+    }
+    m_sent_bytes = 0;
+    m_session.buffers().release(m_buffer);
+    m_buffer = NULL;
+    m_tdo_offset.clear();
+    m_session.clear_expected_read();
+}
+
+CommandBuffer &ScanBatch::buffer()
+{
+    if(m_buffer == NULL)
+        m_buffer = m_session.buffers().acquire();
+    if(m_need_reset){
+        m_session.reset(*m_buffer);
+        m_need_reset = false;
+    }
+    return *m_buffer;
+}
+
+int ScanBatch::add_reset()
+{
+    CommandBuffer &buf = buffer();
+    m_tdo_offset.push_back(m_session.expected_read());
+    m_session.reset(buf);
+    return size() - 1;
+}
+
+int ScanBatch::add_scan_vdr(int command, int vjtag_instance_ir_width, int vjtag_instance_addr, const BitSpan &tdi,
+                            bool to_read)
+{
+    CommandBuffer &buf = buffer();
+    int read_cnt = m_session.expected_read();
+    if(!m_session.scan_vdr(buf, command, vjtag_instance_ir_width, vjtag_instance_addr, tdi, to_read))
+        return -1;
+    m_tdo_offset.push_back(read_cnt);
+    return size() - 1;
+}
+
+int ScanBatch::add_scan_vdr(const VjtagTarget &target, const BitSpan &command, const BitSpan &tdi, bool to_read)
+{
+    CommandBuffer &buf = buffer();
+    int read_cnt = m_session.expected_read();
+    if(!m_session.scan_vdr(buf, target, command, tdi, to_read))
+        return -1;
+    m_tdo_offset.push_back(read_cnt);
+    return size() - 1;
+}
+
+ScanCost ScanBatch::cost() const
+{
+    if(m_buffer == NULL)
+        return ScanCost();
+    return buffer_cost(m_buffer->data(), m_buffer->size());
+}
+
+bool ScanBatch::execute()
+{
+    CommandBuffer &buf = buffer();
+    m_session.tap().goto_state(buf, TAP_IDL);
+
+    // The bytes are lent to the job, not copied
+    buf.lend(m_job.write_buf);
+    m_job.expected_read = m_session.expected_read();
+    m_pipeline.submit(&m_job);
+    m_pipeline.wait();
+    buf.take_back(m_job.write_buf);
+    m_sent_bytes = buf.size();
+
+    if(!m_job.ok){
+        m_session.invalidate();
+        m_need_reset = true;
+    }
+    return m_job.ok;
+}
+
+bool ScanBatch::tdo(int index, BitSpan &bits) const
+{
+    if(!m_job.ok || index < 0 || index >= size())
+        return false;
+    int read_cnt = m_tdo_offset[index];
+    if(read_cnt + TDO_byte_count(bits.length) > (int) m_job.read_buf.size())
+        return false;
+    return extract_TDO_bits(m_job.read_buf.data(), read_cnt, bits);
+}
@@ -0,0 +1,80 @@
+#ifndef JTAG_SCAN_BATCH_H
+#define JTAG_SCAN_BATCH_H
+/*
+Declares ScanBatch, which encodes VJTAG requests coming from anywhere (sockets, shared memory, ...) into one byte
+buffer through a JtagSession and runs them as one IoPipeline job, i.e. one USB round trip.
+
+The requests are encoded as soon as they are added, so the TDI bits are read from the caller's memory directly and
+only need to stay valid during the add_*() call. Likewise, tdo() extracts the TDO bits straight into the caller's
+memory. The bytes are encoded into a CommandBuffer taken from the session's pool when the batch starts and handed back
+by clear(), so a long-running batch loop does not allocate once the buffer has grown to the largest batch.
+
+Usage:
+    ScanBatch batch(transport, USER1_DR_LENGTH);
+    int a = batch.add_scan_vdr(command, ir_width, addr, tdi_a, true);
+    int b = batch.add_scan_vdr(command, ir_width, addr, tdi_b, false);
+    if(batch.execute())
+        batch.tdo(a, tdo_a);
+    batch.clear();
+*/
+#include <vector>
+#include "ftd2xx.h"
+#include "bit_span.h"
+#include "transport.h"
+#include "session.h"
+#include "pipeline.h"
+#include "scan_cost.h"
+
+class ScanBatch {
+public:
+    // The transport is not owned and must outlive the batch
+    ScanBatch(Transport *transport, int user1_dr_length, const TransportOptions &options = TransportOptions());
+    ~ScanBatch();
+
+    JtagSession &session() { return m_session; }
+    IoPipeline &pipeline() { return m_pipeline; }
+    int size() const { return (int) m_tdo_offset.size(); }
+    bool need_reset() const { return m_need_reset; }  // whether the next request starts with a reset
+    // Whether bytes were added since the last execute(), i.e. the session is ahead of the chain
+    bool pending() const { return m_buffer != NULL && m_buffer->size() > m_sent_bytes; }
+    bool empty() const { return m_tdo_offset.empty(); }
+
+    // Add a request and return its index in the batch
+    int add_reset();
+    int add_scan_vdr(int command, int vjtag_instance_ir_width, int vjtag_instance_addr, const BitSpan &tdi,
+                     bool to_read);
+    // Both return -1 and add nothing if the target or the command is invalid
+    int add_scan_vdr(const VjtagTarget &target, const BitSpan &command, const BitSpan &tdi, bool to_read);
+
+    // The cost of the requests added so far (buffer_cost of their bytes, scan_cost.h), to decide whether to execute
+    // the batch now or add more
+    ScanCost cost() const;
+
+    // Write the batch and read its TDO bytes. The batch ends in [Run_Test/Idle], so the Update-DR of the last scan
+    // (which acts on the next falling edge of TCK) takes effect within the batch. Returns false if the transfer
+    // failed, in which case the tap controller is reset at the beginning of the next batch.
+    bool execute();
+
+    // The TDO bits of the request `index` of the executed batch. bits.length must be the length of its scan.
+    bool tdo(int index, BitSpan &bits) const;
+
+    // Start the next batch. If the requests added were not executed, the session no longer matches the chain, so its
+    // caches are forgotten and the next batch begins with a reset.
+    void clear();
+
+private:
+    ScanBatch(const ScanBatch &);
+    ScanBatch &operator=(const ScanBatch &);
+
+    CommandBuffer &buffer();
+
+    IoPipeline m_pipeline;
+    JtagSession m_session;
+    IoJob m_job;
+    CommandBuffer *m_buffer;        // from m_session.buffers(), NULL until the batch adds something
+    std::vector<int> m_tdo_offset;  // per request, where its TDO bytes begin in m_job.read_buf
+    int m_sent_bytes;               // the bytes of m_buffer written by execute()
+    bool m_need_reset;
+};
+
+#endif // JTAG_SCAN_BATCH_H
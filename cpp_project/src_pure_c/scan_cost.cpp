@@ -0,0 +1,159 @@
+/*
+This file implements the cost model of the encodings of jtag_tap.h.
+*/
+#include "scan_cost.h"
+#include "jtag_tap.h"
+#include "ir_dr_util.h"
+
+double ScanCost::time_ns(const CostParams &params) const
+{
+    return bytes_written * params.write_byte_ns + bytes_read * params.read_byte_ns +
+           shift_tcks * params.shift_tck_ns;
+}
+
+ScanCost &ScanCost::operator+=(const ScanCost &other)
+{
+    bytes_written += other.bytes_written;
+    bytes_read += other.bytes_read;
+    tcks += other.tcks;
+    shift_tcks += other.shift_tcks;
+    return *this;
+}
+
+// `n` TCKs with TMS only (state transitions), or bit-banged bits of which `nread` are read
+static ScanCost bit_bang_cost(int n, int nread)
+{
+    ScanCost cost;
+    cost.bytes_written = 2LL * n;
+    cost.bytes_read = nread;
+    cost.tcks = n;
+    return cost;
+}
+
+// The full bytes before the last bit in ByteShift segments, the rest bit-banged
+static ScanCost byte_shift_cost(int length, bool to_read)
+{
+    int nbytes = (length-1) / 8;
+    int nbits = length - 8 * nbytes;
+    ScanCost cost = bit_bang_cost(nbits, to_read? nbits : 0);
+    cost.bytes_written += nbytes + (nbytes + BYTESHIFT_MAX_NBYTES - 1) / BYTESHIFT_MAX_NBYTES;
+    cost.bytes_read += to_read? nbytes : 0;
+    cost.tcks += 8LL * nbytes;
+    cost.shift_tcks = 8LL * nbytes;
+    return cost;
+}
+
+ScanCost shift_cost(int length, bool to_read)
+{
+    if(length <= 0)
+        return ScanCost();
+    return byte_shift_cost(length, to_read);
+}
+
+ScanCost masked_shift_cost(int length, int nread, bool reads_all)
+{
+    if(length <= 0)
+        return ScanCost();
+    return reads_all? byte_shift_cost(length, true) : bit_bang_cost(length, nread);
+}
+
+bool masked_shift_reads_all(int length, int nread, const CostParams &params)
+{
+    return masked_shift_cost(length, nread, true).time_ns(params) <
+           masked_shift_cost(length, nread, false).time_ns(params);
+}
+
+int read_mask_count(const BitSpan &read_mask)
+{
+    int n = 0;
+    int nbytes = read_mask.length / 8;
+    for(int i = 0; i < nbytes; ++i)
+        n += __builtin_popcount(read_mask.data[i]);
+    for(int i = 8 * nbytes; i < read_mask.length; ++i)
+        n += read_mask.get(i);
+    return n;
+}
+
+bool masked_shift_reads_all(const BitSpan &read_mask, const CostParams &params)
+{
+    return masked_shift_reads_all(read_mask.length, read_mask_count(read_mask), params);
+}
+
+// The TMS-only TCKs of common_functions_shift_data: IDL -> SDS (-> SIS) -> CAP -> SR (or EX1 if there are no bits),
+// then EX1 -> UPD -> IDL
+static int scan_tms_clocks(bool is_ir_shift)
+{
+    return is_ir_shift? 6 : 5;
+}
+
+ScanCost scan_cost(int length, bool to_read, bool is_ir_shift)
+{
+    ScanCost cost = bit_bang_cost(scan_tms_clocks(is_ir_shift), 0);
+    cost += shift_cost(length, to_read);
+    return cost;
+}
+
+ScanCost scan_cost(const BitSpan &read_mask, bool is_ir_shift, const CostParams &params)
+{
+    ScanCost cost = bit_bang_cost(scan_tms_clocks(is_ir_shift), 0);
+    int nread = read_mask_count(read_mask);
+    cost += masked_shift_cost(read_mask.length, nread, masked_shift_reads_all(read_mask.length, nread, params));
+    return cost;
+}
+
+ScanCost tms_cost(int n)
+{
+    return bit_bang_cost(n, 0);
+}
+
+ScanCost idle_cost(int n)
+{
+    if(n <= 0)
+        return ScanCost();
+    int nbytes = n / 8;
+    ScanCost cost = bit_bang_cost(n % 8, 0);
+    cost.bytes_written += nbytes + (nbytes + BYTESHIFT_MAX_NBYTES - 1) / BYTESHIFT_MAX_NBYTES;
+    cost.tcks += 8LL * nbytes;
+    cost.shift_tcks = 8LL * nbytes;
+    return cost;
+}
+
+ScanCost vir_load_cost(int user1_dr_length)
+{
+    ScanCost cost = scan_cost(IR_LENGTH, false, true);
+    cost += scan_cost(user1_dr_length, false);
+    cost += scan_cost(user1_dr_length, false);
+    cost += scan_cost(IR_LENGTH, false, true);
+    return cost;
+}
+
+ScanCost buffer_cost(const BYTE *buf, int nbytes)
+{
+    ScanCost cost;
+    cost.bytes_written = nbytes;
+    TdoCounter counter;
+    int consumed;
+    cost.bytes_read = counter.count(buf, nbytes, 0x7FFFFFFF, consumed);
+
+    // A BitBanging byte clocks the tap controller when it raises TCK
+    int shift_remaining = 0;
+    bool tck = false;
+    for(int i = 0; i < nbytes; ++i){
+        BYTE b = buf[i];
+        if(shift_remaining > 0){
+            --shift_remaining;
+            cost.shift_tcks += 8;
+        }
+        else if(b & 0x80){
+            shift_remaining = b & BYTESHIFT_MAX_NBYTES;
+            tck = false;  // the ByteShift mode leaves TCK low
+        }
+        else{
+            if((b & 0x01) && !tck)
+                ++cost.tcks;
+            tck = (b & 0x01) != 0;
+        }
+    }
+    cost.tcks += cost.shift_tcks;
+    return cost;
+}
@@ -0,0 +1,75 @@
+#ifndef JTAG_SCAN_COST_H
+#define JTAG_SCAN_COST_H
+/*
+Declares the cost model of the encodings of jtag_tap.h: the bytes written, the TDO bytes read and the TCKs of a scan,
+and an estimate of its time on the USB-Blaster.
+
+A bit-banged bit costs 2 written bytes and, if read, 1 TDO byte. A ByteShift byte costs 1 written byte (plus the
+initiating byte of its segment) and 1 TDO byte for 8 bits, but it can only read all of its bits or none. The encoders
+use the model to pick the encoding of every shift:
+1. For an unmasked shift (read all bits or none), ByteShift is never more expensive for the full bytes before the last
+   bit, so the common functions always use it there and bit-bang the rest.
+2. For a masked shift (read only the bits set in a read mask), bit-banging reads exactly the masked bits and ByteShift
+   reads all of them. masked_shift_reads_all() compares the two, and MaskedRead (jtag_tap.h) records its answer for
+   the common functions, TDO_byte_count() and extract_TDO_bits().
+
+The estimates leave out the bytes spent keeping the ByteShift segments within the USB packets (an initiating or a
+padding byte where a segment is cut at a packet boundary, at most 2 per packet); buffer_cost() measures an encoded
+buffer exactly. ScanBatch::cost() and VjtagBatch::estimate() apply them to batches.
+
+Usage:
+    ScanCost cost = scan_cost(1024, true);
+    cost += idle_cost(5000);
+    printf("%lld bytes out, %lld bytes in, %.1f us\n", cost.bytes_written, cost.bytes_read, cost.time_ns() / 1000);
+*/
+#include "ftd2xx.h"
+#include "bit_span.h"
+
+// The time of the USB-Blaster steps, by default a full speed USB link (about 1 MB/s each way) and the 6 MHz TCK of
+// the ByteShift mode
+struct CostParams {
+    CostParams() : write_byte_ns(1000.0), read_byte_ns(1000.0), shift_tck_ns(1000.0 / 6) {}
+
+    double write_byte_ns;  // per byte written; a bit-banged TCK takes 2 bytes
+    double read_byte_ns;   // per TDO byte read
+    double shift_tck_ns;   // per TCK clocked by a ByteShift byte
+};
+
+struct ScanCost {
+    ScanCost() : bytes_written(0), bytes_read(0), tcks(0), shift_tcks(0) {}
+
+    long long bytes_written;
+    long long bytes_read;
+    long long tcks;        // all the TCKs, the state transitions included
+    long long shift_tcks;  // the TCKs clocked in the ByteShift mode
+
+    double time_ns(const CostParams &params = CostParams()) const;
+    ScanCost &operator+=(const ScanCost &other);
+};
+
+// From [Shift_DR/IR], shift `length` (> 0) bits and end in [Exit1_DR/IR] (common_functions_SR_to_EX1), reading all
+// the bits if `to_read`
+ScanCost shift_cost(int length, bool to_read);
+// The same with a read mask, bit-banged (reading `nread` bits) or as a ByteShift read of all the bits
+ScanCost masked_shift_cost(int length, int nread, bool reads_all);
+// Whether the masked shift is cheaper as a ByteShift read of all the bits. This is what the common functions do.
+bool masked_shift_reads_all(int length, int nread, const CostParams &params = CostParams());
+bool masked_shift_reads_all(const BitSpan &read_mask, const CostParams &params = CostParams());
+// The number of bits set in the read mask
+int read_mask_count(const BitSpan &read_mask);
+
+// common_functions_IDL_to_SIR_to_IDL / common_functions_IDL_to_SDR_to_IDL
+ScanCost scan_cost(int length, bool to_read, bool is_ir_shift = false);
+ScanCost scan_cost(const BitSpan &read_mask, bool is_ir_shift = false, const CostParams &params = CostParams());
+// idle_clocks
+ScanCost idle_cost(int n);
+// `n` bit-banged TCKs with no data, i.e. state transitions
+ScanCost tms_cost(int n);
+// Selecting a VJTAG instance and loading its VIR: USER1 to the IR, VIR_CAPTURE and the command through the USER1 DR,
+// and USER0 back to the IR (the preamble of JtagSession::scan_vdr)
+ScanCost vir_load_cost(int user1_dr_length);
+
+// The exact cost of an encoded buffer
+ScanCost buffer_cost(const BYTE *buf, int nbytes);
+
+#endif // JTAG_SCAN_COST_H
@@ -0,0 +1,213 @@
+/*
+This file implements the JtagSession IR/VIR caching.
+*/
+#include <string.h>
+#include "session.h"
+#include "ir_dr_util.h"
+#include "jtag_tap.h"
+
+JtagSession::JtagSession(int user1_dr_length)
+    : m_user1_dr_length(user1_dr_length), m_ir(-1), m_selected_addr(-1), m_vir_loads(0)
+{
+}
+
+void JtagSession::invalidate()
+{
+    m_ir = -1;
+    m_selected_addr = -1;
+    m_vir.clear();
+}
+
+void JtagSession::reset(BYTE *buf, int &cnt)
+{
+    m_tap.reset(buf, cnt);
+    m_tap.goto_state(buf, cnt, TAP_IDL);
+    invalidate();
+}
+
+void JtagSession::load_ir(BYTE *buf, int &cnt, int instruction)
+{
+    if(m_ir == instruction)
+        return;
+    BYTE data_bytes[2];
+    BitSpan data(data_bytes, 0);
+    prepare_IR_data(data, instruction);
+    m_tap.scan_ir(buf, cnt, data, false);
+    m_ir = instruction;
+}
+
+// The key of an instance in the caches: its address bits in place in the USER1 DR. This is vjtag_instance_addr in the
+// int form and target.addr << target.vir_width in the VjtagTarget form, so both forms find the same entry.
+static long long target_key(const VjtagTarget &target)
+{
+    return (long long) target.addr << target.vir_width;
+}
+
+bool JtagSession::vir_cached(long long addr_key, const BitSpan &command_dr) const
+{
+    if(m_selected_addr != addr_key)
+        return false;
+    std::map<long long, std::vector<BYTE> >::const_iterator it = m_vir.find(addr_key);
+    return it != m_vir.end() && (int) it->second.size() == command_dr.num_bytes() &&
+           memcmp(it->second.data(), command_dr.data, command_dr.num_bytes()) == 0;
+}
+
+void JtagSession::load_user1_dr(BYTE *buf, int &cnt, long long addr_key, const BitSpan &command_dr)
+{
+    if(vir_cached(addr_key, command_dr))
+        return;
+
+    // The instance is (re)addressed through the USER1 DR even if only the selection changes
+    BYTE data_bytes[USER1_DR_MAX_LENGTH / 8];
+    BitSpan data(data_bytes, 0);
+    load_ir(buf, cnt, IR_USER1);
+    prepare_USER1DR_data_VIR_CAPTURE(data, command_dr.length);
+    m_tap.scan_dr(buf, cnt, data, false);
+    m_tap.scan_dr(buf, cnt, command_dr, false);
+
+    m_selected_addr = addr_key;
+    m_vir[addr_key].assign(command_dr.data, command_dr.data + command_dr.num_bytes());
+    ++m_vir_loads;
+}
+
+bool JtagSession::load_vir(BYTE *buf, int &cnt, int command, int vjtag_instance_ir_width, int vjtag_instance_addr)
+{
+    BYTE data_bytes[USER1_DR_MAX_LENGTH / 8];
+    BitSpan data(data_bytes, 0);
+    if(!prepare_USER1DR_data_Command(data, command, vjtag_instance_ir_width, vjtag_instance_addr, m_user1_dr_length))
+        return false;
+    load_user1_dr(buf, cnt, vjtag_instance_addr, data);
+    return true;
+}
+
+bool JtagSession::load_vir(BYTE *buf, int &cnt, const VjtagTarget &target, const BitSpan &command)
+{
+    BYTE data_bytes[USER1_DR_MAX_LENGTH / 8];
+    BitSpan data(data_bytes, 0);
+    if(!prepare_USER1DR_data_VIR(data, target, command))
+        return false;
+    load_user1_dr(buf, cnt, target_key(target), data);
+    return true;
+}
+
+bool JtagSession::vir_loaded(const VjtagTarget &target, const BitSpan &command) const
+{
+    BYTE data_bytes[USER1_DR_MAX_LENGTH / 8];
+    BitSpan data(data_bytes, 0);
+    return prepare_USER1DR_data_VIR(data, target, command) && vir_cached(target_key(target), data);
+}
+
+void JtagSession::set_min_idle(int vjtag_instance_addr, int clocks)
+{
+    if(clocks > 0)
+        m_min_idle[vjtag_instance_addr] = clocks;
+    else
+        m_min_idle.erase(vjtag_instance_addr);
+}
+
+void JtagSession::set_min_idle(const VjtagTarget &target, int clocks)
+{
+    set_min_idle(target_key(target), clocks);
+}
+
+int JtagSession::min_idle_of(long long addr_key) const
+{
+    std::map<long long, int>::const_iterator it = m_min_idle.find(addr_key);
+    return (it != m_min_idle.end())? it->second : 0;
+}
+
+int JtagSession::min_idle(int vjtag_instance_addr) const
+{
+    return min_idle_of(vjtag_instance_addr);
+}
+
+int JtagSession::min_idle(const VjtagTarget &target) const
+{
+    return min_idle_of(target_key(target));
+}
+
+void JtagSession::idle_after_update(BYTE *buf, int &cnt, long long addr_key)
+{
+    int clocks = min_idle_of(addr_key);
+    if(clocks > 0)
+        m_tap.idle(buf, cnt, clocks);
+}
+
+bool JtagSession::scan_vdr(BYTE *buf, int &cnt, int command, int vjtag_instance_ir_width, int vjtag_instance_addr,
+                           const BitSpan &bits, bool to_read)
+{
+    if(!load_vir(buf, cnt, command, vjtag_instance_ir_width, vjtag_instance_addr))
+        return false;
+    load_ir(buf, cnt, IR_USER0);
+    m_tap.scan_dr(buf, cnt, bits, to_read);
+    idle_after_update(buf, cnt, vjtag_instance_addr);
+    return true;
+}
+
+bool JtagSession::scan_vdr(BYTE *buf, int &cnt, const VjtagTarget &target, const BitSpan &command,
+                           const BitSpan &bits, bool to_read)
+{
+    if(!load_vir(buf, cnt, target, command))
+        return false;
+    load_ir(buf, cnt, IR_USER0);
+    m_tap.scan_dr(buf, cnt, bits, to_read);
+    idle_after_update(buf, cnt, target_key(target));
+    return true;
+}
+
+// An upper bound of the bytes scan_vdr appends before the DR scan: USER1 to the IR, VIR_CAPTURE and the command
+// through the USER1 DR, and USER0 to the IR
+static int max_preamble_bytes(int user1_dr_length)
+{
+    return 2 * max_scan_bytes(IR_LENGTH) + 2 * max_scan_bytes(user1_dr_length);
+}
+
+void JtagSession::reset(CommandBuffer &buf)
+{
+    buf.reserve(2 * max_scan_bytes(0));
+    reset(buf.data(), buf.cnt());
+    buf.check();
+}
+
+void JtagSession::load_ir(CommandBuffer &buf, int instruction)
+{
+    buf.reserve(max_scan_bytes(IR_LENGTH));
+    load_ir(buf.data(), buf.cnt(), instruction);
+    buf.check();
+}
+
+bool JtagSession::load_vir(CommandBuffer &buf, int command, int vjtag_instance_ir_width, int vjtag_instance_addr)
+{
+    buf.reserve(max_preamble_bytes(m_user1_dr_length));
+    bool ok = load_vir(buf.data(), buf.cnt(), command, vjtag_instance_ir_width, vjtag_instance_addr);
+    buf.check();
+    return ok;
+}
+
+bool JtagSession::scan_vdr(CommandBuffer &buf, int command, int vjtag_instance_ir_width, int vjtag_instance_addr,
+                           const BitSpan &bits, bool to_read)
+{
+    buf.reserve(max_preamble_bytes(m_user1_dr_length) + max_scan_bytes(bits.length) +
+                max_idle_bytes(min_idle(vjtag_instance_addr)));
+    bool ok = scan_vdr(buf.data(), buf.cnt(), command, vjtag_instance_ir_width, vjtag_instance_addr, bits, to_read);
+    buf.check();
+    return ok;
+}
+
+bool JtagSession::load_vir(CommandBuffer &buf, const VjtagTarget &target, const BitSpan &command)
+{
+    buf.reserve(max_preamble_bytes(USER1_DR_MAX_LENGTH));
+    bool ok = load_vir(buf.data(), buf.cnt(), target, command);
+    buf.check();
+    return ok;
+}
+
+bool JtagSession::scan_vdr(CommandBuffer &buf, const VjtagTarget &target, const BitSpan &command, const BitSpan &bits,
+                           bool to_read)
+{
+    buf.reserve(max_preamble_bytes(USER1_DR_MAX_LENGTH) + max_scan_bytes(bits.length) +
+                max_idle_bytes(min_idle(target)));
+    bool ok = scan_vdr(buf.data(), buf.cnt(), target, command, bits, to_read);
+    buf.check();
+    return ok;
+}
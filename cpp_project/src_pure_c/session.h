@@ -0,0 +1,109 @@
+#ifndef JTAG_SESSION_H
+#define JTAG_SESSION_H
+/*
+Declares JtagSession, which prepares VJTAG transactions in a byte buffer and remembers what the previous transactions
+already loaded into the JTAG chain.
+
+Every virtual DR scan needs the instruction register (IR) to hold USER0 and the SLD hub to have the target VJTAG
+instance selected with the right virtual instruction (VIR). Loading the VIR takes 3 scans (USER1 to the IR,
+VIR_CAPTURE and the command through the USER1 DR) plus one more to put USER0 back. The session caches the IR loaded in
+the tap controller, the instance the hub currently routes USER0 to, and the last VIR loaded in every instance, and
+skips the scans whose result is already in place. The caches are invalidated by reset().
+
+Instances are given either as (ir_width, shifted address, int command) like prepare_USER1DR_data_Command, or as a
+VjtagTarget with a command of any width (prepare_USER1DR_data_VIR). Both forms share the caches.
+
+Some commands need time after their Update-DR before the next scan (e.g. to finish a memory access in the TCK domain).
+set_min_idle() gives an instance the TCKs to wait in [Run_Test/Idle] after each of its DR scans, and scan_vdr() adds
+them (idle_clocks, jtag_tap.h) so the callers do not have to.
+
+Every call also has a CommandBuffer form (command_buffer.h), and the session holds the CommandBufferPool its batches
+take their buffers from, so that steady-state batches reuse the same buffers instead of allocating.
+
+As with JtagTap, the caches are only correct if every byte appended to the buffer in between goes through the session.
+*/
+#include <map>
+#include <vector>
+#include "ftd2xx.h"
+#include "bit_span.h"
+#include "tap_state.h"
+#include "command_buffer.h"
+#include "ir_dr_util.h"
+
+class JtagSession {
+public:
+    explicit JtagSession(int user1_dr_length);
+
+    JtagTap &tap() { return m_tap; }
+    int expected_read() const { return m_tap.expected_read(); }  // see JtagTap::expected_read
+    void clear_expected_read() { m_tap.clear_expected_read(); }
+    int user1_dr_length() const { return m_user1_dr_length; }
+    int ir() const { return m_ir; }  // the instruction in the IR, -1 if unknown
+
+    // Sync the tap controller to [Run_Test/Idle] and forget everything cached
+    void reset(BYTE *buf, int &cnt);
+    // Forget the cached IR/VIR without touching the buffer, e.g. after the buffer is discarded or the FPGA reprogrammed
+    void invalidate();
+
+    // Load a 10-bit instruction (e.g. IR_USER0, IR_USER1) to the IR unless it is already loaded
+    void load_ir(BYTE *buf, int &cnt, int instruction);
+
+    // Select the VJTAG instance at `vjtag_instance_addr` (see prepare_USER1DR_data_Command) and load `command` to its
+    // VIR, unless both are already in place. This leaves USER1 in the IR. Nothing is appended and false is returned if
+    // prepare_USER1DR_data_Command cannot encode the arguments (USER1DR_data_Command_valid()).
+    bool load_vir(BYTE *buf, int &cnt, int command, int vjtag_instance_ir_width, int vjtag_instance_addr);
+
+    // Shift `bits` through the DR of the VJTAG instance while `command` is in its VIR. Only the scans that are not
+    // already in place are added before the USER0 DR scan. False if load_vir() is.
+    bool scan_vdr(BYTE *buf, int &cnt, int command, int vjtag_instance_ir_width, int vjtag_instance_addr,
+                  const BitSpan &bits, bool to_read);
+
+    // The same for a VjtagTarget. Nothing is appended and false is returned if the target or the command is invalid.
+    bool load_vir(BYTE *buf, int &cnt, const VjtagTarget &target, const BitSpan &command);
+    bool scan_vdr(BYTE *buf, int &cnt, const VjtagTarget &target, const BitSpan &command, const BitSpan &bits,
+                  bool to_read);
+
+    // The same on a CommandBuffer, reserving the worst case of each call (the IR/USER1 DR scans included) once
+    void reset(CommandBuffer &buf);
+    void load_ir(CommandBuffer &buf, int instruction);
+    bool load_vir(CommandBuffer &buf, int command, int vjtag_instance_ir_width, int vjtag_instance_addr);
+    bool scan_vdr(CommandBuffer &buf, int command, int vjtag_instance_ir_width, int vjtag_instance_addr,
+                  const BitSpan &bits, bool to_read);
+    bool load_vir(CommandBuffer &buf, const VjtagTarget &target, const BitSpan &command);
+    bool scan_vdr(CommandBuffer &buf, const VjtagTarget &target, const BitSpan &command, const BitSpan &bits,
+                  bool to_read);
+
+    // Wait at least `clocks` TCKs in [Run_Test/Idle] after every DR scan of the instance; 0 (the default) does not
+    // wait. This is a setting of the instance, kept by reset() and invalidate().
+    void set_min_idle(int vjtag_instance_addr, int clocks);
+    void set_min_idle(const VjtagTarget &target, int clocks);
+    int min_idle(int vjtag_instance_addr) const;
+    int min_idle(const VjtagTarget &target) const;
+
+    // The buffers of the batches built on this session
+    CommandBufferPool &buffers() { return m_buffers; }
+
+    // Whether the instance is selected with `command` in its VIR, i.e. a scan_vdr would go straight to the DR scan
+    bool vir_loaded(const VjtagTarget &target, const BitSpan &command) const;
+    // The number of VIR loads (VIR_CAPTURE + command) appended so far
+    unsigned long long vir_loads() const { return m_vir_loads; }
+
+private:
+    void load_user1_dr(BYTE *buf, int &cnt, long long addr_key, const BitSpan &command_dr);
+    bool vir_cached(long long addr_key, const BitSpan &command_dr) const;
+    int min_idle_of(long long addr_key) const;
+    void idle_after_update(BYTE *buf, int &cnt, long long addr_key);
+
+    JtagTap m_tap;
+    int m_user1_dr_length;
+
+    int m_ir;                   // instruction in the IR, -1 if unknown
+    long long m_selected_addr;  // instance the hub routes USER0 DR scans to, -1 if unknown
+    // The last USER1 DR (command and address) loaded in each instance, keyed by the address shifted past the VIR bits
+    std::map<long long, std::vector<BYTE> > m_vir;
+    unsigned long long m_vir_loads;
+    std::map<long long, int> m_min_idle;  // TCKs to wait after the DR scans of each instance, same keys as m_vir
+    CommandBufferPool m_buffers;
+};
+
+#endif // JTAG_SESSION_H
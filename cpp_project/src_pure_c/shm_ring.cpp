@@ -0,0 +1,270 @@
+/*
+This file implements the shared-memory submission/completion rings.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <new>
+#include <thread>
+#include "shm_ring.h"
+#include "jtag_server.h"
+#include "ir_dr_util.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "the ring indices must be lock-free to be shared between processes");
+
+#ifndef _WIN32
+
+static int payload_bytes(int nbits)
+{
+    return (nbits + 7) / 8;
+}
+
+
+bool JtagShmClient::create(const char *name, uint32_t arena_size)
+{
+    close();
+    size_t size = sizeof(JtagShmHeader) + arena_size;
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd < 0){
+        printf("Cannot create the shared memory %s\n", name);
+        return false;
+    }
+    void *p = MAP_FAILED;
+    if(ftruncate(fd, size) == 0)
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED){
+        shm_unlink(name);
+        return false;
+    }
+
+    m_header = new (p) JtagShmHeader;
+    m_header->sq_head.store(0);
+    m_header->sq_tail.store(0);
+    m_header->cq_head.store(0);
+    m_header->cq_tail.store(0);
+    m_header->arena_size = arena_size;
+    std::atomic_thread_fence(std::memory_order_release);
+    m_header->magic = JTAG_SHM_MAGIC;
+    m_size = size;
+    m_name = name;
+    return true;
+}
+
+void JtagShmClient::close()
+{
+    if(m_header == NULL)
+        return;
+    m_header->magic = 0;  // the server detaches the segment
+    munmap(m_header, m_size);
+    shm_unlink(m_name.c_str());
+    m_header = NULL;
+}
+
+bool JtagShmClient::submit(const JtagShmScan &scan)
+{
+    uint32_t tail = m_header->sq_tail.load(std::memory_order_relaxed);
+    if(tail - m_header->sq_head.load(std::memory_order_acquire) >= JTAG_SHM_RING_ENTRIES)
+        return false;
+    m_header->sq[tail % JTAG_SHM_RING_ENTRIES] = scan;
+    m_header->sq_tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+bool JtagShmClient::complete(JtagShmCompletion &completion)
+{
+    uint32_t head = m_header->cq_head.load(std::memory_order_relaxed);
+    if(head == m_header->cq_tail.load(std::memory_order_acquire))
+        return false;
+    completion = m_header->cq[head % JTAG_SHM_RING_ENTRIES];
+    m_header->cq_head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+
+JtagShmServer::JtagShmServer(Transport *transport, int user1_dr_length, const TransportOptions &options)
+    : m_batch(transport, user1_dr_length, options), m_user1_dr_length(user1_dr_length), m_stopping(false)
+{
+}
+
+JtagShmServer::~JtagShmServer()
+{
+    for(size_t i = 0; i < m_segments.size(); ++i)
+        munmap(m_segments[i].header, m_segments[i].size);
+}
+
+void JtagShmServer::unmap(size_t i)
+{
+    munmap(m_segments[i].header, m_segments[i].size);
+    m_segments.erase(m_segments.begin() + i);
+}
+
+void JtagShmServer::detach(const char *name)
+{
+    for(size_t i = 0; i < m_segments.size(); ++i){
+        if(m_segments[i].name == name){
+            unmap(i);
+            return;
+        }
+    }
+}
+
+bool JtagShmServer::attach(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if(fd < 0){
+        printf("Cannot open the shared memory %s\n", name);
+        return false;
+    }
+    struct stat st;
+    void *p = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(JtagShmHeader))
+        p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED)
+        return false;
+
+    Segment segment;
+    segment.header = (JtagShmHeader *) p;
+    segment.size = st.st_size;
+    segment.arena_size = segment.size - sizeof(JtagShmHeader);
+    segment.name = name;
+    if(segment.header->magic != JTAG_SHM_MAGIC ||
+       sizeof(JtagShmHeader) + (size_t) segment.header->arena_size > segment.size){
+        printf("Not a JTAG shared memory: %s\n", name);
+        munmap(p, segment.size);
+        return false;
+    }
+    m_segments.push_back(segment);
+    return true;
+}
+
+bool JtagShmServer::valid(const Segment &segment, const JtagShmScan &scan) const
+{
+    if(scan.op == JTAG_OP_RESET)
+        return true;
+    if(scan.op != JTAG_OP_SCAN_VDR || scan.nbits <= 0 || scan.nbits > JTAG_SERVER_MAX_BITS ||
+       !USER1DR_data_Command_valid(scan.command, scan.ir_width, scan.addr, m_user1_dr_length))
+        return false;
+    uint64_t arena_size = segment.arena_size;
+    uint64_t nbytes = payload_bytes(scan.nbits);
+    if(scan.tdi_offset + nbytes > arena_size)
+        return false;
+    return !(scan.flags & JTAG_FLAG_READ) || scan.tdo_offset + nbytes <= arena_size;
+}
+
+int JtagShmServer::poll()
+{
+    // Take the submissions that have room for their completion, encoding them straight from the arenas
+    m_batch.clear();
+    m_pending.clear();
+    for(size_t i = 0; i < m_segments.size(); ){
+        if(m_segments[i].header->magic != JTAG_SHM_MAGIC)
+            unmap(i);  // closed by its client
+        else
+            ++i;
+    }
+    for(size_t i = 0; i < m_segments.size(); ++i){
+        Segment &segment = m_segments[i];
+        JtagShmHeader *h = segment.header;
+        uint32_t head = h->sq_head.load(std::memory_order_relaxed);
+        uint32_t tail = h->sq_tail.load(std::memory_order_acquire);
+        uint32_t cq_free = JTAG_SHM_RING_ENTRIES - (h->cq_tail.load(std::memory_order_relaxed) -
+                                                    h->cq_head.load(std::memory_order_acquire));
+        for(uint32_t n = 0; head != tail && n < cq_free; ++head, ++n){
+            Pending pending;
+            pending.segment = &segment;
+            pending.scan = h->sq[head % JTAG_SHM_RING_ENTRIES];  // the client may not change it once validated
+            pending.index = -1;
+            if(valid(segment, pending.scan)){
+                const JtagShmScan &scan = pending.scan;
+                if(scan.op == JTAG_OP_RESET){
+                    pending.index = m_batch.add_reset();
+                }
+                else{
+                    BitSpan tdi((BYTE *)(h + 1) + scan.tdi_offset, scan.nbits);
+                    pending.index = m_batch.add_scan_vdr(scan.command, scan.ir_width, scan.addr, tdi,
+                                                         (scan.flags & JTAG_FLAG_READ) != 0);
+                }
+            }
+            m_pending.push_back(pending);
+        }
+        h->sq_head.store(head, std::memory_order_release);
+    }
+    if(m_pending.empty())
+        return 0;
+
+    bool ok = m_batch.empty() || m_batch.execute();
+
+    // Extract the TDO bits into the arenas and post the completions
+    for(size_t i = 0; i < m_pending.size(); ++i){
+        Pending &p = m_pending[i];
+        JtagShmHeader *h = p.segment->header;
+        JtagShmCompletion completion;
+        completion.user_data = p.scan.user_data;
+        completion.reserved = 0;
+        if(p.index < 0)
+            completion.status = JTAG_STATUS_BAD_REQUEST;
+        else if(!ok)
+            completion.status = JTAG_STATUS_IO_ERROR;
+        else{
+            completion.status = JTAG_STATUS_OK;
+            if(p.scan.op == JTAG_OP_SCAN_VDR && (p.scan.flags & JTAG_FLAG_READ)){
+                BitSpan tdo((BYTE *)(h + 1) + p.scan.tdo_offset, p.scan.nbits);
+                m_batch.tdo(p.index, tdo);
+            }
+        }
+        uint32_t tail = h->cq_tail.load(std::memory_order_relaxed);
+        h->cq[tail % JTAG_SHM_RING_ENTRIES] = completion;
+        h->cq_tail.store(tail + 1, std::memory_order_release);
+    }
+    return (int) m_pending.size();
+}
+
+void JtagShmServer::run()
+{
+    int idle = 0;
+    while(!m_stopping){
+        if(poll() > 0){
+            idle = 0;
+            continue;
+        }
+        // Spin for the next submission of a busy client without any syscall, then back off to not burn a core
+        ++idle;
+        if(idle < 2000)
+            continue;
+        if(idle < 4000)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+#else // _WIN32
+
+bool JtagShmClient::create(const char *name, uint32_t) { printf("Not supported on Windows: %s\n", name); return false; }
+void JtagShmClient::close() {}
+bool JtagShmClient::submit(const JtagShmScan &) { return false; }
+bool JtagShmClient::complete(JtagShmCompletion &) { return false; }
+
+JtagShmServer::JtagShmServer(Transport *transport, int user1_dr_length, const TransportOptions &options)
+    : m_batch(transport, user1_dr_length, options), m_user1_dr_length(user1_dr_length), m_stopping(false)
+{
+}
+
+JtagShmServer::~JtagShmServer() {}
+bool JtagShmServer::attach(const char *name) { printf("Not supported on Windows: %s\n", name); return false; }
+void JtagShmServer::detach(const char *) {}
+void JtagShmServer::unmap(size_t) {}
+bool JtagShmServer::valid(const Segment &, const JtagShmScan &) const { return false; }
+int JtagShmServer::poll() { return 0; }
+void JtagShmServer::run() {}
+
+#endif // _WIN32
@@ -0,0 +1,134 @@
+#ifndef JTAG_SHM_RING_H
+#define JTAG_SHM_RING_H
+/*
+Declares the shared-memory transport between local client processes and the process that owns the USB-Blaster.
+
+A socket (jtag_server.h) costs a few syscalls and copies per request. Here, each client creates a POSIX shared memory
+segment (shm_open) holding a submission ring, a completion ring and an arena for the packed bits:
+
+    JtagShmHeader | submission ring | completion ring | arena (arena_size bytes)
+
+The client writes the TDI bits into the arena and a JtagShmScan descriptor pointing at them into the submission ring.
+JtagShmServer, in the owning process, maps the same segment, encodes the scans straight from the arena into one
+ScanBatch (scan_batch.h) per poll, and extracts the TDO bits straight into the arena before posting the completions.
+Neither side copies the payload and no syscall is made on the hot path.
+
+Each ring has exactly one producer and one consumer, so the head and tail indices are plain atomics: the producer
+publishes an entry with a release store of its tail, the consumer frees it with a release store of its head. A
+segment is meant for one client thread; use one segment per thread.
+
+The client owns the arena layout. The TDI bits must not be modified and the TDO bits must not be read until the
+completion of the scan arrives.
+
+POSIX only. On Windows, create() and attach() fail.
+*/
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "ftd2xx.h"
+#include "transport.h"
+#include "scan_batch.h"
+
+#define JTAG_SHM_MAGIC          0x4A544147  // "JTAG"
+#define JTAG_SHM_RING_ENTRIES   256         // a power of 2
+
+// A submission. op, flags, the VJTAG fields and the status of the completion are as in jtag_server.h.
+struct JtagShmScan {
+    uint64_t user_data;   // returned in the completion
+    uint32_t op;          // JTAG_OP_*
+    uint32_t flags;       // JTAG_FLAG_*
+    int32_t command;
+    int32_t ir_width;
+    int32_t addr;
+    int32_t nbits;
+    uint32_t tdi_offset;  // of the packed TDI bits in the arena
+    uint32_t tdo_offset;  // of the packed TDO bits in the arena, written if JTAG_FLAG_READ
+};
+
+struct JtagShmCompletion {
+    uint64_t user_data;
+    int32_t status;       // JTAG_STATUS_*
+    int32_t reserved;
+};
+
+struct JtagShmHeader {
+    uint32_t magic;
+    uint32_t arena_size;
+    // Each index on its own cache line, so the two processes do not bounce a line they both write
+    alignas(64) std::atomic<uint32_t> sq_head;  // written by the server
+    alignas(64) std::atomic<uint32_t> sq_tail;  // written by the client
+    alignas(64) std::atomic<uint32_t> cq_head;  // written by the client
+    alignas(64) std::atomic<uint32_t> cq_tail;  // written by the server
+    alignas(64) JtagShmScan sq[JTAG_SHM_RING_ENTRIES];
+    JtagShmCompletion cq[JTAG_SHM_RING_ENTRIES];
+};
+
+class JtagShmClient {
+public:
+    JtagShmClient() : m_header(NULL), m_size(0) {}
+    ~JtagShmClient() { close(); }
+
+    // Create the segment `name` (e.g. "/jtag-1234", see shm_open) with an arena of `arena_size` bytes
+    bool create(const char *name, uint32_t arena_size);
+    void close();  // unmaps and removes the segment, and tells the server to detach it
+
+    BYTE *arena() { return (BYTE *)(m_header + 1); }
+    uint32_t arena_size() const { return m_header->arena_size; }
+
+    // Returns false if the submission ring is full
+    bool submit(const JtagShmScan &scan);
+    // Returns false if no completion is ready
+    bool complete(JtagShmCompletion &completion);
+
+private:
+    JtagShmClient(const JtagShmClient &);
+    JtagShmClient &operator=(const JtagShmClient &);
+
+    JtagShmHeader *m_header;
+    size_t m_size;
+    std::string m_name;
+};
+
+class JtagShmServer {
+public:
+    // The transport is not owned and must outlive the server
+    JtagShmServer(Transport *transport, int user1_dr_length, const TransportOptions &options = TransportOptions());
+    ~JtagShmServer();
+
+    // Map a segment created by a JtagShmClient. Like poll(), not concurrently with the other calls.
+    bool attach(const char *name);
+    // Unmap it. A segment whose client called close() is detached by the next poll() on its own.
+    void detach(const char *name);
+
+    // Execute the scans submitted so far by all the clients as one batch. Returns the number of scans completed.
+    int poll();
+
+    // Call poll() until stop() is called (from any thread). When idle, it spins for a while before sleeping.
+    void run();
+    void stop() { m_stopping = true; }
+
+private:
+    struct Segment {
+        JtagShmHeader *header;
+        size_t size;
+        uint64_t arena_size;    // of the mapping, not header->arena_size, which the client can still change
+        std::string name;
+    };
+    struct Pending {
+        Segment *segment;
+        JtagShmScan scan;
+        int index;              // in m_batch, -1 if rejected
+    };
+
+    bool valid(const Segment &segment, const JtagShmScan &scan) const;
+    void unmap(size_t i);
+
+    ScanBatch m_batch;
+    int m_user1_dr_length;
+    std::vector<Segment> m_segments;
+    std::vector<Pending> m_pending;
+    std::atomic<bool> m_stopping;
+};
+
+#endif // JTAG_SHM_RING_H
@@ -0,0 +1,187 @@
+/*
+This file implements the JtagTap state tracker and the shortest TMS paths between the tap controller states.
+*/
+#include "tap_state.h"
+#include "jtag_tap.h"
+
+// NEXT_STATE[state][tms], from the tap controller state machine in IEEE 1149.1
+static const TapState NEXT_STATE[TAP_NUM_STATES][2] = {
+    /* TAP_RST    */ {TAP_IDL,    TAP_RST},
+    /* TAP_IDL    */ {TAP_IDL,    TAP_SDS},
+    /* TAP_SDS    */ {TAP_CAP_DR, TAP_SIS},
+    /* TAP_CAP_DR */ {TAP_SDR,    TAP_EX1_DR},
+    /* TAP_SDR    */ {TAP_SDR,    TAP_EX1_DR},
+    /* TAP_EX1_DR */ {TAP_PAU_DR, TAP_UPD_DR},
+    /* TAP_PAU_DR */ {TAP_PAU_DR, TAP_EX2_DR},
+    /* TAP_EX2_DR */ {TAP_SDR,    TAP_UPD_DR},
+    /* TAP_UPD_DR */ {TAP_IDL,    TAP_SDS},
+    /* TAP_SIS    */ {TAP_CAP_IR, TAP_RST},
+    /* TAP_CAP_IR */ {TAP_SIR,    TAP_EX1_IR},
+    /* TAP_SIR    */ {TAP_SIR,    TAP_EX1_IR},
+    /* TAP_EX1_IR */ {TAP_PAU_IR, TAP_UPD_IR},
+    /* TAP_PAU_IR */ {TAP_PAU_IR, TAP_EX2_IR},
+    /* TAP_EX2_IR */ {TAP_SIR,    TAP_UPD_IR},
+    /* TAP_UPD_IR */ {TAP_IDL,    TAP_SDS},
+};
+
+// Shortest paths: PATH_TMS[from][to] holds the TMS bits (bit i for the i-th TCK) and PATH_LEN[from][to] the number of
+// TCKs. No path is longer than 8 TCKs, so the TMS bits fit in a byte.
+static BYTE PATH_TMS[TAP_NUM_STATES][TAP_NUM_STATES];
+static BYTE PATH_LEN[TAP_NUM_STATES][TAP_NUM_STATES];
+
+static bool build_paths()
+{
+    // Breadth first search from every state
+    for(int from = 0; from < TAP_NUM_STATES; ++from){
+        bool visited[TAP_NUM_STATES] = {false};
+        int queue[TAP_NUM_STATES];
+        int head = 0, tail = 0;
+        visited[from] = true;
+        PATH_TMS[from][from] = 0;
+        PATH_LEN[from][from] = 0;
+        queue[tail++] = from;
+        while(head < tail){
+            int s = queue[head++];
+            for(int tms = 0; tms < 2; ++tms){
+                int t = NEXT_STATE[s][tms];
+                if(visited[t])
+                    continue;
+                visited[t] = true;
+                PATH_TMS[from][t] = PATH_TMS[from][s] | (tms << PATH_LEN[from][s]);
+                PATH_LEN[from][t] = PATH_LEN[from][s] + 1;
+                queue[tail++] = t;
+            }
+        }
+    }
+    return true;
+}
+
+static const bool PATHS_READY = build_paths();
+
+
+TapState tap_next_state(TapState state, BYTE tms)
+{
+    if(state >= TAP_NUM_STATES)
+        return (tms)? TAP_UNKNOWN : state;  // only 5 TMS==1 bring an unknown state back, see JtagTap::reset
+    return NEXT_STATE[state][tms & 0b1];
+}
+
+int JtagTap::path_length(TapState from, TapState to)
+{
+    return PATH_LEN[from][to];
+}
+
+void JtagTap::reset(BYTE *buf, int &cnt)
+{
+    for(int i = 0; i < 5; ++i)
+        atomic_state_trans_RST_to_RST(buf, cnt);
+    m_state = TAP_RST;
+}
+
+void JtagTap::goto_state(BYTE *buf, int &cnt, TapState target)
+{
+    if(m_state == TAP_UNKNOWN)
+        reset(buf, cnt);
+    BYTE tms = PATH_TMS[m_state][target];
+    for(int i = 0; i < PATH_LEN[m_state][target]; ++i)
+        atomic_state_trans_TMS(buf, cnt, (tms >> i) & 0b1);
+    m_state = target;
+}
+
+void JtagTap::idle(BYTE *buf, int &cnt, int clocks)
+{
+    goto_state(buf, cnt, TAP_IDL);
+    idle_clocks(buf, cnt, clocks);
+}
+
+void JtagTap::scan(BYTE *buf, int &cnt, const BitSpan &bits, bool to_read, const MaskedRead *read_mask,
+                   bool is_ir_shift, TapState end_state)
+{
+    if(bits.length > 0){
+        goto_state(buf, cnt, is_ir_shift? TAP_SIR : TAP_SDR);
+        if(read_mask != NULL){
+            common_functions_SR_to_EX1(buf, cnt, bits, *read_mask);
+            m_expected_read += TDO_byte_count(*read_mask);
+        }
+        else{
+            common_functions_SR_to_EX1(buf, cnt, bits, to_read);
+            if(to_read)
+                m_expected_read += TDO_byte_count(bits.length);
+        }
+        m_state = is_ir_shift? TAP_EX1_IR : TAP_EX1_DR;
+    }
+    else{
+        // Capture then directly exit, as common_functions_IDL_to_SDR_to_IDL does for zero length
+        goto_state(buf, cnt, is_ir_shift? TAP_CAP_IR : TAP_CAP_DR);
+    }
+    goto_state(buf, cnt, end_state);
+}
+
+void JtagTap::scan_ir(BYTE *buf, int &cnt, const BitSpan &bits, bool to_read, TapState end_state)
+{
+    scan(buf, cnt, bits, to_read, NULL, true, end_state);
+}
+
+void JtagTap::scan_dr(BYTE *buf, int &cnt, const BitSpan &bits, bool to_read, TapState end_state)
+{
+    scan(buf, cnt, bits, to_read, NULL, false, end_state);
+}
+
+void JtagTap::scan_ir(BYTE *buf, int &cnt, const BitSpan &bits, const MaskedRead &read_mask, TapState end_state)
+{
+    scan(buf, cnt, bits, false, &read_mask, true, end_state);
+}
+
+void JtagTap::scan_dr(BYTE *buf, int &cnt, const BitSpan &bits, const MaskedRead &read_mask, TapState end_state)
+{
+    scan(buf, cnt, bits, false, &read_mask, false, end_state);
+}
+
+void JtagTap::reset(CommandBuffer &buf)
+{
+    buf.reserve(max_scan_bytes(0));
+    reset(buf.data(), buf.cnt());
+    buf.check();
+}
+
+void JtagTap::goto_state(CommandBuffer &buf, TapState target)
+{
+    buf.reserve(max_scan_bytes(0));
+    goto_state(buf.data(), buf.cnt(), target);
+    buf.check();
+}
+
+void JtagTap::idle(CommandBuffer &buf, int clocks)
+{
+    buf.reserve(max_scan_bytes(0) + max_idle_bytes(clocks));
+    idle(buf.data(), buf.cnt(), clocks);
+    buf.check();
+}
+
+void JtagTap::scan_ir(CommandBuffer &buf, const BitSpan &bits, bool to_read, TapState end_state)
+{
+    buf.reserve(max_scan_bytes(bits.length));
+    scan(buf.data(), buf.cnt(), bits, to_read, NULL, true, end_state);
+    buf.check();
+}
+
+void JtagTap::scan_dr(CommandBuffer &buf, const BitSpan &bits, bool to_read, TapState end_state)
+{
+    buf.reserve(max_scan_bytes(bits.length));
+    scan(buf.data(), buf.cnt(), bits, to_read, NULL, false, end_state);
+    buf.check();
+}
+
+void JtagTap::scan_ir(CommandBuffer &buf, const BitSpan &bits, const MaskedRead &read_mask, TapState end_state)
+{
+    buf.reserve(max_scan_bytes(bits.length));
+    scan(buf.data(), buf.cnt(), bits, false, &read_mask, true, end_state);
+    buf.check();
+}
+
+void JtagTap::scan_dr(CommandBuffer &buf, const BitSpan &bits, const MaskedRead &read_mask, TapState end_state)
+{
+    buf.reserve(max_scan_bytes(bits.length));
+    scan(buf.data(), buf.cnt(), bits, false, &read_mask, false, end_state);
+    buf.check();
+}
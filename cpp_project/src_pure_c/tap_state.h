@@ -0,0 +1,94 @@
+#ifndef TAP_STATE_H
+#define TAP_STATE_H
+/*
+Declares JtagTap, which keeps track of the JTAG tap controller state while the byte buffer is prepared.
+
+The atomic_state_trans_* functions (jtag_tap.h) leave it to the caller to know the current state, and the common
+functions always start and end in [Run_Test/Idle]. JtagTap instead remembers the state the buffer leaves the tap
+controller in, and moves between any two of the 16 states with the shortest TMS sequence (precomputed for all pairs).
+Scans end in [Update_DR/IR] by default, so back-to-back scans go [Update_DR/IR] -> [Select_DR_Scan] directly without
+stopping in [Run_Test/Idle].
+
+The tracked state is only correct if every byte appended to the buffer in between goes through the JtagTap (or the
+caller calls set_state()).
+*/
+#include "ftd2xx.h"
+#include "bit_span.h"
+#include "command_buffer.h"
+#include "jtag_tap.h"  // MaskedRead
+
+enum TapState {
+    TAP_RST = 0,   // Test_Logic/Reset
+    TAP_IDL,       // Run_Test/Idle
+    TAP_SDS,       // Select_DR_Scan
+    TAP_CAP_DR,    // Capture_DR
+    TAP_SDR,       // Shift_DR
+    TAP_EX1_DR,    // Exit1_DR
+    TAP_PAU_DR,    // Pause_DR
+    TAP_EX2_DR,    // Exit2_DR
+    TAP_UPD_DR,    // Update_DR
+    TAP_SIS,       // Select_IR_Scan
+    TAP_CAP_IR,    // Capture_IR
+    TAP_SIR,       // Shift_IR
+    TAP_EX1_IR,    // Exit1_IR
+    TAP_PAU_IR,    // Pause_IR
+    TAP_EX2_IR,    // Exit2_IR
+    TAP_UPD_IR,    // Update_IR
+    TAP_NUM_STATES,
+    TAP_UNKNOWN = TAP_NUM_STATES  // e.g. right after the device is opened
+};
+
+// The state after one TCK with the given TMS
+TapState tap_next_state(TapState state, BYTE tms);
+
+class JtagTap {
+public:
+    JtagTap() : m_state(TAP_UNKNOWN), m_expected_read(0) {}
+
+    TapState state() const { return m_state; }
+    void set_state(TapState state) { m_state = state; }
+
+    // Go to [Test_Logic/Reset] by clocking TMS==1 5 times. This works from any (including unknown) state.
+    void reset(BYTE *buf, int &cnt);
+
+    // Go to `target` with the shortest TMS sequence. If the current state is unknown, reset first.
+    void goto_state(BYTE *buf, int &cnt, TapState target);
+
+    // Shift the bits through IR (or DR) from the current state and end in `end_state`. The bits are handled by
+    // common_functions_SR_to_EX1 (jtag_tap.h), so the TDO bytes have the same layout as the common functions.
+    void scan_ir(BYTE *buf, int &cnt, const BitSpan &bits, bool to_read, TapState end_state = TAP_UPD_IR);
+    void scan_dr(BYTE *buf, int &cnt, const BitSpan &bits, bool to_read, TapState end_state = TAP_UPD_DR);
+    void scan_ir(BYTE *buf, int &cnt, const BitSpan &bits, const MaskedRead &read_mask,
+                 TapState end_state = TAP_UPD_IR);
+    void scan_dr(BYTE *buf, int &cnt, const BitSpan &bits, const MaskedRead &read_mask,
+                 TapState end_state = TAP_UPD_DR);
+
+    // Go to [Run_Test/Idle] and stay there for `clocks` more TCKs (see idle_clocks, jtag_tap.h)
+    void idle(BYTE *buf, int &cnt, int clocks);
+
+    // The same on a CommandBuffer, reserving the worst case of each call once (see max_scan_bytes)
+    void reset(CommandBuffer &buf);
+    void goto_state(CommandBuffer &buf, TapState target);
+    void idle(CommandBuffer &buf, int clocks);
+    void scan_ir(CommandBuffer &buf, const BitSpan &bits, bool to_read, TapState end_state = TAP_UPD_IR);
+    void scan_dr(CommandBuffer &buf, const BitSpan &bits, bool to_read, TapState end_state = TAP_UPD_DR);
+    void scan_ir(CommandBuffer &buf, const BitSpan &bits, const MaskedRead &read_mask, TapState end_state = TAP_UPD_IR);
+    void scan_dr(CommandBuffer &buf, const BitSpan &bits, const MaskedRead &read_mask, TapState end_state = TAP_UPD_DR);
+
+    // The number of TDO bytes the scans appended so far will produce, i.e. exactly how many bytes to read back after
+    // writing the buffer. Clear it when a new buffer is started.
+    int expected_read() const { return m_expected_read; }
+    void clear_expected_read() { m_expected_read = 0; }
+
+    // The number of TCKs goto_state() takes between two known states
+    static int path_length(TapState from, TapState to);
+
+private:
+    void scan(BYTE *buf, int &cnt, const BitSpan &bits, bool to_read, const MaskedRead *read_mask, bool is_ir_shift,
+              TapState end_state);
+
+    TapState m_state;
+    int m_expected_read;
+};
+
+#endif // TAP_STATE_H
@@ -0,0 +1,165 @@
+/*
+This file implements TransactionTemplate: recording the encodings and patching the data into them.
+*/
+#include <string.h>
+#include "transaction_template.h"
+
+// The BitBanging/ByteShift byte flags, see jtag_tap.cpp
+#define TCK   0x01
+#define TDI   0x10
+#define SHIFT 0x80
+
+TransactionTemplate::TransactionTemplate(int data_length, const Encoder &encoder, int max_bytes)
+    : m_data_length(data_length), m_encoder(encoder), m_max_bytes(max_bytes)
+{
+}
+
+void TransactionTemplate::encode(int position, const BitSpan &data, std::vector<BYTE> &bytes)
+{
+    // The bytes before `position` stand for the rest of the USB packet. The encoder reserves what it writes, so a too
+    // long encoding grows the buffer and is rejected here instead of overrunning it.
+    CommandBuffer buf(position + m_max_bytes);
+    buf.cnt() = position;
+    m_encoder(buf, data);
+    buf.check();
+    if(buf.size() - position > m_max_bytes){
+        bytes.clear();
+        return;
+    }
+    bytes.assign(buf.data() + position, buf.data() + buf.size());
+}
+
+bool TransactionTemplate::record(int position, Recording &recording)
+{
+    int nbytes = (m_data_length + 7) / 8;
+    std::vector<BYTE> zeros_data(nbytes, 0x00), ones_data(nbytes, 0xFF);
+    std::vector<BYTE> ones;
+    encode(position, BitSpan(zeros_data.data(), m_data_length), recording.bytes);
+    encode(position, BitSpan(ones_data.data(), m_data_length), ones);
+    const std::vector<BYTE> &zeros = recording.bytes;
+    if(zeros.empty() || zeros.size() != ones.size())
+        return false;
+
+    // Walk the bytes in order. The data bits are shifted in order, so every difference is the next data bit, except
+    // the TCK high byte of a bit-banged bit, which repeats the TDI of the TCK low byte before it.
+    std::vector<Patch> &patches = recording.patches;
+    patches.clear();
+    int next_bit = 0;
+    int shift_remaining = 0;
+    bool prev_tdi_low = false;  // the previous byte set up the TDI of a bit-banged data bit with TCK low
+    for(int i = 0; i < (int) zeros.size(); ++i){
+        BYTE diff = zeros[i] ^ ones[i];
+        bool tdi_low = false;
+        if(shift_remaining > 0){
+            // ByteShift data byte, one TDI per bit
+            --shift_remaining;
+            if(diff == 0xFF){
+                Patch *last = patches.empty()? NULL : &patches.back();
+                if(last != NULL && last->nbytes > 0 && last->offset + last->nbytes == i &&
+                   last->bit + 8 * last->nbytes == next_bit){
+                    ++last->nbytes;
+                }
+                else{
+                    Patch patch = {i, next_bit, 1, 0};
+                    patches.push_back(patch);
+                }
+                next_bit += 8;
+            }
+            else{
+                for(int j = 0; j < 8; ++j){
+                    if((diff >> j) & 0b1){
+                        Patch patch = {i, next_bit++, 0, (BYTE)(1 << j)};
+                        patches.push_back(patch);
+                    }
+                }
+            }
+        }
+        else if(zeros[i] & SHIFT){
+            if(diff != 0)
+                return false;
+            shift_remaining = zeros[i] & BYTESHIFT_MAX_NBYTES;
+        }
+        else if(diff != 0){
+            if(diff != TDI)
+                return false;
+            if((zeros[i] & TCK) && prev_tdi_low){
+                Patch patch = {i, patches.back().bit, 0, TDI};
+                patches.push_back(patch);
+            }
+            else{
+                Patch patch = {i, next_bit++, 0, TDI};
+                patches.push_back(patch);
+                tdi_low = !(zeros[i] & TCK);
+            }
+        }
+        prev_tdi_low = tdi_low;
+    }
+    if(next_bit > m_data_length)
+        return false;
+
+    // Check the patches against the encoder with a pattern that is neither constant nor periodic
+    std::vector<BYTE> pattern(nbytes), expected, patched(zeros.size());
+    unsigned seed = 0x2545F491u;
+    for(int i = 0; i < nbytes; ++i){
+        seed = seed * 1103515245u + 12345u;
+        pattern[i] = (BYTE)(seed >> 16);
+    }
+    BitSpan pattern_bits(pattern.data(), m_data_length);
+    encode(position, pattern_bits, expected);
+    apply(recording, patched.data(), pattern_bits);
+    if(expected != patched)
+        return false;
+
+    TdoCounter counter;
+    int consumed;
+    recording.expected_read = counter.count(zeros.data(), (int) zeros.size(), 0x7FFFFFFF, consumed);
+    return true;
+}
+
+void TransactionTemplate::apply(const Recording &recording, BYTE *dst, const BitSpan &data)
+{
+    memcpy(dst, recording.bytes.data(), recording.bytes.size());
+    for(size_t k = 0; k < recording.patches.size(); ++k){
+        const Patch &patch = recording.patches[k];
+        if(patch.nbytes > 0){
+            if(patch.bit % 8 == 0){
+                memcpy(dst + patch.offset, data.data + patch.bit / 8, patch.nbytes);
+            }
+            else{
+                // The run starts inside a data byte
+                int shift = patch.bit % 8;
+                int first = patch.bit / 8;
+                for(int i = 0; i < patch.nbytes; ++i){
+                    int high = (first + i + 1 < data.num_bytes())? data.data[first + i + 1] : 0;
+                    dst[patch.offset + i] = (BYTE)((data.data[first + i] >> shift) | (high << (8 - shift)));
+                }
+            }
+        }
+        else if(data.get(patch.bit)){
+            dst[patch.offset] |= patch.mask;
+        }
+    }
+}
+
+bool TransactionTemplate::append(BYTE *buf, int &cnt, int &expected_read, const BitSpan &data)
+{
+    if(data.length != m_data_length)
+        return false;
+    int position = cnt % USB_PACKET_SIZE;
+    Recording &recording = m_recordings[position];
+    if(recording.state == Recording::NOT_RECORDED)
+        recording.state = record(position, recording)? Recording::RECORDED : Recording::FAILED;
+    if(recording.state != Recording::RECORDED)
+        return false;
+
+    apply(recording, buf + cnt, data);
+    cnt += (int) recording.bytes.size();
+    expected_read += recording.expected_read;
+    return true;
+}
+
+bool TransactionTemplate::append(CommandBuffer &buf, int &expected_read, const BitSpan &data)
+{
+    buf.reserve(m_max_bytes);
+    return append(buf.data(), buf.cnt(), expected_read, data);
+}
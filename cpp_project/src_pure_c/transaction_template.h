@@ -0,0 +1,85 @@
+#ifndef JTAG_TRANSACTION_TEMPLATE_H
+#define JTAG_TRANSACTION_TEMPLATE_H
+/*
+Declares TransactionTemplate, a transaction encoded once and replayed with new data by patching the data bits into a
+copy of its bytes.
+
+Most transactions have the same shape every time, e.g. the USER1/VIR/USER0 scans followed by an 8-bit DR write, and
+only the data bits change. Encoding them through the atomic_state_trans_* chain costs a function call per TCK. A
+template runs the encoder twice, with all data bits 0 and with all data bits 1, and keeps the bytes of the first run
+and where the two runs differ: the TDI flags of the bit-banged bits and the ByteShift data bytes. Replaying it is then a
+memcpy of the bytes, a memcpy per run of whole ByteShift bytes, and one store per bit-banged data bit.
+
+Where the ByteShift segments fall depends on the position of the transaction in its USB packet (see USB_PACKET_SIZE),
+so the template records the encoding of every position (cnt % USB_PACKET_SIZE) the first time it is used there.
+
+The encoder must:
+1. depend on the data only through the TDI bits it shifts, each data bit being shifted at most once and in order,
+2. start and end in [Run_Test/Idle] like the common functions of jtag_tap.h,
+3. write through the CommandBuffer overloads, reserving for any raw atomic_state_trans_* call itself
+   (command_buffer.h), so that the recording buffer grows instead of overflowing.
+It writes to the buffer directly, so the JtagTap/JtagSession caches do not see the transaction. Every recording is
+checked against the encoder with a third data pattern, and append() fails if the encoder does not meet 1 or appends
+more than max_bytes().
+
+Usage:
+    TransactionTemplate write_leds(8, [](CommandBuffer &buf, const BitSpan &data){
+        ...  // USER1, VIR_CAPTURE, the command and USER0, as in SendBufOperation_BitBangBasic
+        common_functions_IDL_to_SDR_to_IDL(buf, data, false);
+    });
+    for(...)
+        write_leds.append(buf, cnt, expected_read, data);
+*/
+#include <functional>
+#include <vector>
+#include "ftd2xx.h"
+#include "bit_span.h"
+#include "jtag_tap.h"
+#include "command_buffer.h"
+
+class TransactionTemplate {
+public:
+    typedef std::function<void(CommandBuffer &buf, const BitSpan &data)> Encoder;
+
+    // `data_length` is the number of data bits of every transaction. `max_bytes` bounds the bytes of a transaction; an
+    // encoder appending more is recorded as failed.
+    TransactionTemplate(int data_length, const Encoder &encoder, int max_bytes = 4096);
+
+    int data_length() const { return m_data_length; }
+    // The bytes append() writes at most, for sizing the buffer
+    int max_bytes() const { return m_max_bytes; }
+
+    // Append the transaction with the data (data.length == data_length()) and add its TDO bytes to expected_read.
+    // Returns false if the encoder could not be recorded (see above), in which case nothing is appended.
+    bool append(BYTE *buf, int &cnt, int &expected_read, const BitSpan &data);
+    bool append(CommandBuffer &buf, int &expected_read, const BitSpan &data);
+
+private:
+    // Data bits to copy into the bytes at `offset`. A run covers `nbytes` whole ByteShift data bytes holding the data
+    // bits from `bit` on; a single bit (nbytes == 0) sets `mask` in the byte if the data bit is 1.
+    struct Patch {
+        int offset;
+        int bit;
+        int nbytes;
+        BYTE mask;
+    };
+    struct Recording {
+        Recording() : state(NOT_RECORDED), expected_read(0) {}
+
+        enum { NOT_RECORDED, RECORDED, FAILED } state;
+        std::vector<BYTE> bytes;     // the encoding with all data bits 0
+        std::vector<Patch> patches;
+        int expected_read;
+    };
+
+    bool record(int position, Recording &recording);
+    void encode(int position, const BitSpan &data, std::vector<BYTE> &bytes);
+    static void apply(const Recording &recording, BYTE *dst, const BitSpan &data);
+
+    int m_data_length;
+    Encoder m_encoder;
+    int m_max_bytes;
+    Recording m_recordings[USB_PACKET_SIZE];
+};
+
+#endif // JTAG_TRANSACTION_TEMPLATE_H
@@ -0,0 +1,127 @@
+/*
+This file implements the Transport functions shared by all the backends.
+*/
+#include <chrono>
+#include <thread>
+#include "transport.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#endif
+
+void Transport::wait_readable(int)
+{
+    std::this_thread::yield();
+}
+
+bool Transport::read_exact(BYTE *buf, DWORD nbytes, DWORD &nread, int timeout_ms)
+{
+    nread = 0;
+    std::chrono::steady_clock::time_point last_progress = std::chrono::steady_clock::now();
+    while(nread < nbytes){
+        DWORD queued = 0;
+        if(!queue_status(queued))
+            return false;
+        if(queued > 0){
+            DWORD n = 0;
+            if(queued > nbytes - nread)
+                queued = nbytes - nread;
+            if(!read(buf + nread, queued, n))
+                return false;
+            nread += n;
+            last_progress = std::chrono::steady_clock::now();
+        }
+        else{
+            int waited_ms = (int) std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - last_progress).count();
+            if(waited_ms > timeout_ms)
+                return false;
+            wait_readable(timeout_ms - waited_ms);
+        }
+    }
+    return true;
+}
+
+
+#ifndef _WIN32
+
+ReadableSignal::ReadableSignal()
+{
+    m_fd[0] = m_fd[1] = -1;
+#ifdef __linux__
+    m_fd[0] = m_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+    if(pipe(m_fd) == 0){
+        for(int i = 0; i < 2; ++i){
+            fcntl(m_fd[i], F_SETFL, fcntl(m_fd[i], F_GETFL) | O_NONBLOCK);
+            fcntl(m_fd[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+#endif
+}
+
+ReadableSignal::~ReadableSignal()
+{
+    if(m_fd[0] >= 0)
+        close(m_fd[0]);
+    if(m_fd[1] >= 0 && m_fd[1] != m_fd[0])
+        close(m_fd[1]);
+}
+
+void ReadableSignal::notify()
+{
+    if(m_fd[1] < 0)
+        return;
+#ifdef __linux__
+    eventfd_write(m_fd[1], 1);
+#else
+    char c = 0;
+    ssize_t n = write(m_fd[1], &c, 1);  // a full pipe is already readable
+    (void) n;
+#endif
+}
+
+void ReadableSignal::clear()
+{
+    if(m_fd[0] < 0)
+        return;
+#ifdef __linux__
+    eventfd_t value;
+    eventfd_read(m_fd[0], &value);
+#else
+    char tmp[64];
+    while(read(m_fd[0], tmp, sizeof(tmp)) > 0)
+        ;
+#endif
+}
+
+bool ReadableSignal::wait(int timeout_ms)
+{
+    if(m_fd[0] < 0){
+        std::this_thread::yield();
+        return false;
+    }
+    pollfd p;
+    p.fd = m_fd[0];
+    p.events = POLLIN;
+    p.revents = 0;
+    if(poll(&p, 1, timeout_ms) <= 0)
+        return false;
+    clear();
+    return true;
+}
+
+#else // _WIN32
+
+ReadableSignal::ReadableSignal() { m_fd[0] = m_fd[1] = -1; }
+ReadableSignal::~ReadableSignal() {}
+void ReadableSignal::notify() {}
+void ReadableSignal::clear() {}
+bool ReadableSignal::wait(int) { std::this_thread::yield(); return false; }
+
+#endif // _WIN32
@@ -0,0 +1,90 @@
+#ifndef JTAG_TRANSPORT_H
+#define JTAG_TRANSPORT_H
+/*
+Declares the byte transport to a USB-Blaster.
+
+The buffers prepared by jtag_tap.h / session.h are written through a Transport and the TDO bytes are read back from
+it. Two implementations exist:
+1. FtdiTransport (device.h), the real USB-Blaster through the ftd2xx library.
+2. BlasterEmulator (emulator.h), an in-process software model of the USB-Blaster and the DE0-Nano design, so the
+   project can run (and be benchmarked) without the hardware.
+*/
+#include "ftd2xx.h"
+
+// Runtime options of the transfers, to tune the throughput per workload
+struct TransportOptions {
+    TransportOptions()
+        : usb_transfer_size(4096), latency_timer(2), read_timeout_ms(50), write_timeout_ms(0),
+          device_cache_file(NULL), write_chunk(4096), max_outstanding_read(4096), stall_timeout_ms(1000) {}
+
+    // Applied by open_jtag_device (device.h)
+    ULONG usb_transfer_size;      // FT_SetUSBParameters, for both directions (multiple of 64, up to 64 KB)
+    UCHAR latency_timer;          // FT_SetLatencyTimer, in ms
+    ULONG read_timeout_ms;        // FT_SetTimeouts
+    ULONG write_timeout_ms;       // FT_SetTimeouts, 0 for no timeout
+    const char *device_cache_file; // records the device opened to skip the enumeration next time, NULL to disable
+
+    // Applied by IoPipeline (pipeline.h)
+    DWORD write_chunk;            // bytes per write, a multiple of USB_PACKET_SIZE (rounded down, at least one packet)
+    DWORD max_outstanding_read;   // TDO bytes expected but not read yet, at least USB_PACKET_SIZE
+    int stall_timeout_ms;         // Transport::read_exact timeout
+};
+
+class Transport {
+public:
+    virtual ~Transport() {}
+
+    // Same semantics as FT_Write: send `nbytes` bytes and report how many were sent in `written`.
+    virtual bool write(const BYTE *buf, DWORD nbytes, DWORD &written) = 0;
+
+    // Same semantics as FT_Read: read up to `nbytes` TDO bytes and report how many were read in `nread`.
+    virtual bool read(BYTE *buf, DWORD nbytes, DWORD &nread) = 0;
+
+    // Same semantics as FT_GetQueueStatus: the number of TDO bytes ready to be read.
+    virtual bool queue_status(DWORD &nbytes) = 0;
+
+    // Same semantics as FT_Purge(FT_PURGE_RX): drop the TDO bytes received and not read yet, e.g. the late bytes of a
+    // failed transfer, so they are not taken for the bytes of the next one.
+    virtual void purge() {}
+
+    // Block until TDO bytes may be ready to read, or `timeout_ms` passes. Returning early is allowed. The default only
+    // yields, so the callers poll queue_status(); the backends with a notification of the arriving bytes sleep on it.
+    virtual void wait_readable(int timeout_ms);
+
+    // A file descriptor that becomes readable when TDO bytes arrive, to wait for several transports (and anything else)
+    // in one poll/epoll loop; -1 if not supported. The fd belongs to exactly one waiter, as clearing it eats the wakeup
+    // of any other (wait_readable() and read_exact() have their own signal and never touch it). It stays readable until
+    // clear_readable(), so clear it first and then drain the bytes with queue_status()/read():
+    //     epoll_wait(...);                  // transport->readable_fd() is readable
+    //     transport->clear_readable();
+    //     transport->queue_status(n); transport->read(buf, n, nread);
+    virtual int readable_fd() { return -1; }
+    virtual void clear_readable() {}
+
+    // Read exactly `nbytes` TDO bytes. Only the bytes already queued (queue_status) are read, so the read never waits
+    // for the driver timeout; in between, the loop sleeps in wait_readable(). `timeout_ms` only bounds a stalled
+    // device. Returns false if the device fails or stalls, in which case `nread` tells how many bytes were read.
+    bool read_exact(BYTE *buf, DWORD nbytes, DWORD &nread, int timeout_ms = 1000);
+};
+
+// The file descriptor behind Transport::readable_fd(): an eventfd on Linux, a pipe on the other POSIX systems, and
+// nothing (fd() == -1) on Windows. notify() and clear() may be called from any thread.
+class ReadableSignal {
+public:
+    ReadableSignal();
+    ~ReadableSignal();
+
+    int fd() const { return m_fd[0]; }
+    void notify();
+    void clear();
+    // Wait until notified or `timeout_ms` passes, and clear. Returns false on timeout.
+    bool wait(int timeout_ms);
+
+private:
+    ReadableSignal(const ReadableSignal &);
+    ReadableSignal &operator=(const ReadableSignal &);
+
+    int m_fd[2];  // read end, write end (the same eventfd on Linux)
+};
+
+#endif // JTAG_TRANSPORT_H
@@ -0,0 +1,185 @@
+/*
+This file implements VjtagBatch and its ordering of the scans.
+*/
+#include <algorithm>
+#include <string.h>
+#include "vjtag_batch.h"
+
+VjtagBatch::VjtagBatch(Transport *transport, int user1_dr_length, const TransportOptions &options)
+    : m_batch(transport, user1_dr_length, options), m_segment(0), m_vir_loads(0)
+{
+}
+
+void VjtagBatch::clear()
+{
+    m_batch.clear();
+    m_scans.clear();
+    m_payload.clear();
+    m_segment = 0;
+}
+
+int VjtagBatch::add_scan(const VjtagTarget &target, const BitSpan &command, const BitSpan &tdi, bool to_read)
+{
+    // Reject what the session would reject now rather than at execute()
+    BYTE data_bytes[USER1_DR_MAX_LENGTH / 8];
+    BitSpan data(data_bytes, 0);
+    if(!prepare_USER1DR_data_VIR(data, target, command))
+        return -1;
+
+    Scan scan;
+    scan.target = target;
+    scan.command_offset = (int) m_payload.size();
+    scan.command_length = command.length;
+    m_payload.insert(m_payload.end(), command.data, command.data + command.num_bytes());
+    scan.tdi_offset = (int) m_payload.size();
+    scan.tdi_length = tdi.length;
+    m_payload.insert(m_payload.end(), tdi.data, tdi.data + tdi.num_bytes());
+    scan.to_read = to_read;
+    scan.segment = m_segment;
+    scan.batch_index = -1;
+    m_scans.push_back(scan);
+    return size() - 1;
+}
+
+int VjtagBatch::add_scan(const VjtagTarget &target, unsigned long long command, const BitSpan &tdi, bool to_read)
+{
+    BYTE command_bytes[8];
+    for(int i = 0; i < 8; ++i)
+        command_bytes[i] = (BYTE)(command >> (8 * i));
+    int nbits = (target.ir_width < 64)? target.ir_width : 64;
+    if(nbits < 0 || (nbits < 64 && (command >> nbits) != 0))
+        return -1;
+    return add_scan(target, BitSpan(command_bytes, nbits), tdi, to_read);
+}
+
+void VjtagBatch::barrier()
+{
+    if(!m_scans.empty() && m_scans.back().segment == m_segment)
+        ++m_segment;
+}
+
+// Sort the scans [begin, end) of one segment by instance, keeping the order of the scans of each instance and ranking
+// the instances by their first scan. The instance whose first scan finds its VIR already loaded goes first.
+void VjtagBatch::order_segment(int begin, int end, std::vector<int> &order)
+{
+    std::vector<long long> keys;   // instance address, in the order of the first scans
+    std::vector<int> rank(end - begin);
+    int first = -1;
+    for(int i = begin; i < end; ++i){
+        const Scan &scan = m_scans[i];
+        long long key = (long long) scan.target.addr << scan.target.vir_width;
+        size_t k = std::find(keys.begin(), keys.end(), key) - keys.begin();
+        if(k == keys.size()){
+            keys.push_back(key);
+            if(first < 0 && session().vir_loaded(scan.target, payload(scan.command_offset, scan.command_length)))
+                first = (int) k;
+        }
+        rank[i - begin] = (k == (size_t) first)? -1 : (int) k;
+    }
+
+    order.clear();
+    for(int i = begin; i < end; ++i)
+        order.push_back(i);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b){ return rank[a - begin] < rank[b - begin]; });
+}
+
+bool VjtagBatch::execute()
+{
+    unsigned long long loads = session().vir_loads();
+    std::vector<int> order;
+    int begin = 0;
+    while(begin < size()){
+        int end = begin;
+        while(end < size() && m_scans[end].segment == m_scans[begin].segment)
+            ++end;
+
+        // The session state left by the previous segment decides which instance goes first
+        order_segment(begin, end, order);
+        for(size_t i = 0; i < order.size(); ++i){
+            Scan &scan = m_scans[order[i]];
+            scan.batch_index = m_batch.add_scan_vdr(scan.target, payload(scan.command_offset, scan.command_length),
+                                                    payload(scan.tdi_offset, scan.tdi_length), scan.to_read);
+        }
+        begin = end;
+    }
+    m_vir_loads = (int)(session().vir_loads() - loads);
+    return m_batch.execute();
+}
+
+// The cost of JtagTap::scan_ir/scan_dr from `state`, which it leaves in [Update_DR/IR]
+static ScanCost tap_scan_cost(TapState &state, int length, bool to_read, bool is_ir_shift)
+{
+    TapState shift = is_ir_shift? TAP_SIR : TAP_SDR;
+    ScanCost cost = tms_cost(JtagTap::path_length(state, shift) + 1);  // then Exit1 -> Update
+    cost += shift_cost(length, to_read);
+    state = is_ir_shift? TAP_UPD_IR : TAP_UPD_DR;
+    return cost;
+}
+
+ScanCost VjtagBatch::estimate()
+{
+    ScanCost cost;
+    TapState state = session().tap().state();
+    int ir = session().ir();
+    if(m_batch.need_reset() || state == TAP_UNKNOWN){
+        // JtagSession::reset, which also forgets the VIRs
+        cost += tms_cost(5 + JtagTap::path_length(TAP_RST, TAP_IDL));
+        state = TAP_IDL;
+        ir = -1;
+    }
+
+    std::vector<int> order;
+    const Scan *prev = NULL;
+    int begin = 0;
+    while(begin < size()){
+        int end = begin;
+        while(end < size() && m_scans[end].segment == m_scans[begin].segment)
+            ++end;
+        order_segment(begin, end, order);
+        for(size_t i = 0; i < order.size(); ++i){
+            const Scan &scan = m_scans[order[i]];
+            BitSpan command = payload(scan.command_offset, scan.command_length);
+            bool loaded;
+            if(prev == NULL){
+                loaded = ir != -1 && session().vir_loaded(scan.target, command);
+            }
+            else{
+                const VjtagTarget &a = prev->target, &b = scan.target;
+                loaded = a.addr == b.addr && a.vir_width == b.vir_width && a.addr_width == b.addr_width &&
+                         prev->command_length == scan.command_length &&
+                         memcmp(m_payload.data() + prev->command_offset, command.data, command.num_bytes()) == 0;
+            }
+            // JtagSession::scan_vdr: USER1, VIR_CAPTURE and the command unless loaded, USER0, the DR scan and the
+            // minimum idle
+            if(!loaded){
+                if(ir != IR_USER1)
+                    cost += tap_scan_cost(state, IR_LENGTH, false, true);
+                cost += tap_scan_cost(state, scan.target.user1_dr_length(), false, false);
+                cost += tap_scan_cost(state, scan.target.user1_dr_length(), false, false);
+                ir = IR_USER1;
+            }
+            if(ir != IR_USER0)
+                cost += tap_scan_cost(state, IR_LENGTH, false, true);
+            ir = IR_USER0;
+            cost += tap_scan_cost(state, scan.tdi_length, scan.to_read, false);
+            int idle = session().min_idle(scan.target);
+            if(idle > 0){
+                cost += tms_cost(JtagTap::path_length(state, TAP_IDL));
+                cost += idle_cost(idle);
+                state = TAP_IDL;
+            }
+            prev = &scan;
+        }
+        begin = end;
+    }
+    // ScanBatch::execute returns to [Run_Test/Idle]
+    cost += tms_cost(JtagTap::path_length(state, TAP_IDL));
+    return cost;
+}
+
+bool VjtagBatch::tdo(int index, BitSpan &bits) const
+{
+    if(index < 0 || index >= size())
+        return false;
+    return m_batch.tdo(m_scans[index].batch_index, bits);
+}
@@ -0,0 +1,88 @@
+#ifndef JTAG_VJTAG_BATCH_H
+#define JTAG_VJTAG_BATCH_H
+/*
+Declares VjtagBatch, which collects the DR scans of any number of VJTAG instances and sends them in one USB round trip
+in the order that needs the fewest VIR loads.
+
+Switching to another instance or command costs a USER1 IR scan and two USER1 DR scans (VIR_CAPTURE and the command,
+see JtagSession). Scans added as A1 B1 A2 B2 (A and B being two instances) would switch four times. The batch keeps the
+scans of every instance in the order they were added, but runs the instances one after the other (A1 A2 B1 B2), starting
+with the one the hub already has selected. Scans of different instances are thus assumed not to depend on each other;
+barrier() keeps the scans added before it ahead of the ones added after it when they do.
+
+The command and the TDI bits are copied by add_scan(), so they only need to stay valid during the call. The indices
+returned by add_scan() are the order the scans were added, whatever order they are sent in.
+
+Usage:
+    VjtagBatch batch(transport, hub.user1_dr_length());
+    int a = batch.add_scan(hub.target(*node_a), 0b01, tdi_a, false);
+    int b = batch.add_scan(hub.target(*node_b), 0b10, tdi_b, true);
+    if(batch.execute())
+        batch.tdo(b, tdo_b);
+    batch.clear();
+*/
+#include <vector>
+#include "ftd2xx.h"
+#include "bit_span.h"
+#include "transport.h"
+#include "ir_dr_util.h"
+#include "scan_batch.h"
+#include "scan_cost.h"
+
+class VjtagBatch {
+public:
+    // The transport is not owned and must outlive the batch
+    VjtagBatch(Transport *transport, int user1_dr_length, const TransportOptions &options = TransportOptions());
+
+    JtagSession &session() { return m_batch.session(); }
+    int size() const { return (int) m_scans.size(); }
+    bool empty() const { return m_scans.empty(); }
+
+    // Add a scan of the DR of `target` with `command` in its VIR and return its index. Returns -1 and adds nothing if
+    // the target or the command is invalid (see prepare_USER1DR_data_VIR).
+    int add_scan(const VjtagTarget &target, const BitSpan &command, const BitSpan &tdi, bool to_read);
+    int add_scan(const VjtagTarget &target, unsigned long long command, const BitSpan &tdi, bool to_read);
+    // The scans added so far are sent before the scans added after
+    void barrier();
+
+    // An estimate of the cost of execute() (scan_cost.h): the scans in the order execute() would send them, with a VIR
+    // load wherever the instance or the command changes, following the TAP paths JtagTap takes from the state the
+    // session is in now (the reset of a new or failed batch and the final return to [Run_Test/Idle] included). Like
+    // the scan_cost.h estimates, it leaves out the bytes keeping the ByteShift segments within the USB packets.
+    ScanCost estimate();
+
+    // Order, encode and send the scans as one ScanBatch. Returns false if the transfer failed.
+    bool execute();
+
+    // The TDO bits of the scan `index` of the executed batch. bits.length must be the length of its scan.
+    bool tdo(int index, BitSpan &bits) const;
+
+    // The number of VIR loads the last execute() needed
+    int vir_loads() const { return m_vir_loads; }
+
+    // Start the next batch
+    void clear();
+
+private:
+    struct Scan {
+        VjtagTarget target;
+        int command_offset;     // in m_payload
+        int command_length;
+        int tdi_offset;         // in m_payload
+        int tdi_length;
+        bool to_read;
+        int segment;            // the number of barrier() calls before the scan
+        int batch_index;        // in m_batch, once executed
+    };
+
+    BitSpan payload(int offset, int length) { return BitSpan(m_payload.data() + offset, length); }
+    void order_segment(int begin, int end, std::vector<int> &order);
+
+    ScanBatch m_batch;
+    std::vector<Scan> m_scans;
+    std::vector<BYTE> m_payload;  // the command and TDI bytes of the scans
+    int m_segment;
+    int m_vir_loads;
+};
+
+#endif // JTAG_VJTAG_BATCH_H
@@ -0,0 +1,177 @@
+#ifndef JTAG_VJTAG_INSTANCE_H
+#define JTAG_VJTAG_INSTANCE_H
+/*
+Declares VjtagInstance, a compile-time description of a VJTAG instance whose IR/VIR preambles are generated by the
+compiler.
+
+For a design whose configuration is fixed (the constants copied from Blaster_Comm.map.rpt), the USER0/USER1 IR
+patterns, the VIR_CAPTURE DR and the command DR never change, and neither do the bytes encoding them. VjtagInstance
+builds them as constexpr std::arrays: the packed bits (the same as prepare_IR_data* and prepare_USER1DR_data_*), and
+the encoded preamble of a USER0 DR scan (USER1 to the IR, VIR_CAPTURE and the command through the USER1 DR, USER0 to
+the IR, each from and back to [Run_Test/Idle] as the common functions of jtag_tap.h). Appending the preamble is then one
+memcpy instead of one function call per TCK, and a command, an address or a width that does not fit the USER1 DR is
+a compile error.
+
+The encoding is byte for byte what the common functions produce, including where the ByteShift segments fall, which
+depends on the position in the USB packet (see USB_PACKET_SIZE). The preamble is therefore generated for all the 64
+positions and append_preamble() picks the one for `cnt`.
+
+Like the common functions, the preamble is written to the buffer directly: JtagTap/JtagSession do not see it.
+
+Usage:
+    typedef VjtagInstance<2, 0x10, 5> Leds;  // VJTAG_INSTANCE_IR_WIDTH, VJTAG_INSTANCE_ADDR, USER1_DR_LENGTH
+    Leds::append_preamble<0b01>(buf, cnt);
+    common_functions_IDL_to_SDR_to_IDL(buf, cnt, data, false);
+*/
+#include <string.h>
+#include <array>
+#include <utility>
+#include "ftd2xx.h"
+#include "jtag_tap.h"
+#include "command_buffer.h"
+#include "ir_dr_util.h"
+
+// A constexpr mirror of the BitBanging/ByteShift encoder of jtag_tap.cpp, for shifts that do not read. `position` is
+// the place of data[0] in its USB packet.
+template<int N>
+struct ConstexprEncoder {
+    BYTE data[N];
+    int cnt;
+    int position;
+
+    constexpr explicit ConstexprEncoder(int position) : data(), cnt(0), position(position) {}
+
+    constexpr void put(BYTE b) { data[cnt++] = b; }
+
+    // One TCK with TMS (and TDI) held, as append_TMS*_no_data and atomic_state_trans_SR_to_SR
+    constexpr void clock(int tms, int tdi){
+        BYTE b = (BYTE)(0x0C | (tms? 0x02 : 0) | (tdi? 0x10 : 0));
+        put(b);
+        put((BYTE)(b | 0x01));
+    }
+
+    // shift_data_SR_to_EX1: the full bytes before the last bit in ByteShift segments that stay in one packet, the
+    // leftover bits bit-banged, and the last bit with TMS==1
+    constexpr void shift_SR_to_EX1(unsigned long long bits, int length){
+        int i = 0;
+        int nbytes = (length-1) / 8;
+        while(nbytes > 0){
+            int n = (nbytes > BYTESHIFT_MAX_NBYTES)? BYTESHIFT_MAX_NBYTES : nbytes;
+            int packet_free = USB_PACKET_SIZE - (position + cnt) % USB_PACKET_SIZE;
+            if(packet_free < 2){
+                put(0x0C);
+                packet_free = USB_PACKET_SIZE;
+            }
+            if(n > packet_free - 1)
+                n = packet_free - 1;
+            put((BYTE)(0x80 | n));
+            for(int k = 0; k < n; ++k)
+                put((BYTE)(bits >> (i + 8*k)));
+            i += 8*n;
+            nbytes -= n;
+        }
+        for(; i < length-1; ++i)
+            clock(0, (int)(bits >> i) & 0b1);
+        clock(1, (int)(bits >> (length-1)) & 0b1);
+    }
+
+    // common_functions_IDL_to_SIR_to_IDL / common_functions_IDL_to_SDR_to_IDL without reading
+    constexpr void scan_IDL_to_IDL(unsigned long long bits, int length, bool is_ir_shift){
+        clock(1, 0);            // IDL -> SDS
+        if(is_ir_shift)
+            clock(1, 0);        // SDS -> SIS
+        clock(0, 0);            // -> CAP
+        if(length > 0){
+            clock(0, 0);        // CAP -> SR
+            shift_SR_to_EX1(bits, length);
+        }
+        else{
+            clock(1, 0);        // CAP -> EX1
+        }
+        clock(1, 0);            // EX1 -> UPD
+        clock(0, 0);            // UPD -> IDL
+    }
+};
+
+// Encoded bytes of a preamble at one position in the USB packet
+template<int N>
+struct PreambleBytes {
+    std::array<BYTE, N> bytes;
+    int length;
+};
+
+template<int IrWidth, int Addr, int User1DrLength>
+struct VjtagInstance {
+    static const int VIR_LENGTH = (IrWidth > 4)? IrWidth : 4;  // 4, minimum required by VIR_CAPTURE
+    static const int USER1_DR_BYTES = (User1DrLength + 7) / 8;
+    // An upper bound of the preamble bytes: 2 IR and 2 USER1 DR scans, 2 bytes per bit plus the TMS transitions
+    static const int PREAMBLE_MAX_BYTES = 4 * IR_LENGTH + 4 * User1DrLength + 64;
+
+    static_assert(IrWidth >= 1, "the VJTAG instance needs an IR");
+    static_assert(User1DrLength > VIR_LENGTH && User1DrLength <= 31,
+                  "the USER1 DR holds the VIR and at least one address bit, in at most 31 bits");
+    static_assert(Addr > 0 && (Addr & ((1 << VIR_LENGTH) - 1)) == 0 && (Addr >> User1DrLength) == 0,
+                  "Addr is the instance address shifted past the VIR bits (e.g. 0x10), within the USER1 DR");
+
+    // The USER1 DR holding `command`, as prepare_USER1DR_data_Command
+    static constexpr unsigned command_word(int command) { return (unsigned) command | (unsigned) Addr; }
+
+    // The packed bits of prepare_IR_data_USER0/USER1, prepare_USER1DR_data_VIR_CAPTURE and
+    // prepare_USER1DR_data_Command
+    static constexpr std::array<BYTE, 2> user0_ir() { return {{ (BYTE) IR_USER0, (BYTE)(IR_USER0 >> 8) }}; }
+    static constexpr std::array<BYTE, 2> user1_ir() { return {{ (BYTE) IR_USER1, (BYTE)(IR_USER1 >> 8) }}; }
+    static constexpr std::array<BYTE, USER1_DR_BYTES> vir_capture_dr() {
+        return word_bytes(0x0B, std::make_index_sequence<USER1_DR_BYTES>());  // VIR_CAPTURE: 1, 1, 0, 1
+    }
+    template<int Command>
+    static constexpr std::array<BYTE, USER1_DR_BYTES> command_dr() {
+        static_assert(Command >= 0 && Command < (1 << IrWidth), "the command does not fit the IR of the instance");
+        return word_bytes(command_word(Command), std::make_index_sequence<USER1_DR_BYTES>());
+    }
+
+    // The encoded preamble of a USER0 DR scan with `Command` in the VIR, at `position` in the USB packet
+    template<int Command>
+    static constexpr PreambleBytes<PREAMBLE_MAX_BYTES> preamble(int position) {
+        static_assert(Command >= 0 && Command < (1 << IrWidth), "the command does not fit the IR of the instance");
+        ConstexprEncoder<PREAMBLE_MAX_BYTES> encoder(position);
+        encoder.scan_IDL_to_IDL(IR_USER1, IR_LENGTH, true);
+        encoder.scan_IDL_to_IDL(0x0B, User1DrLength, false);
+        encoder.scan_IDL_to_IDL(command_word(Command), User1DrLength, false);
+        encoder.scan_IDL_to_IDL(IR_USER0, IR_LENGTH, true);
+        return to_preamble(encoder, std::make_index_sequence<PREAMBLE_MAX_BYTES>());
+    }
+
+    // Append the preamble (from [Run_Test/Idle] to [Run_Test/Idle], no TDO bytes): one memcpy of the bytes generated
+    // for the position of `cnt` in its USB packet
+    template<int Command>
+    static void append_preamble(BYTE *buf, int &cnt) {
+        static constexpr std::array<PreambleBytes<PREAMBLE_MAX_BYTES>, USB_PACKET_SIZE> table =
+            preamble_table<Command>(std::make_index_sequence<USB_PACKET_SIZE>());
+        const PreambleBytes<PREAMBLE_MAX_BYTES> &entry = table[cnt % USB_PACKET_SIZE];
+        memcpy(buf + cnt, entry.bytes.data(), entry.length);
+        cnt += entry.length;
+    }
+    template<int Command>
+    static void append_preamble(CommandBuffer &buf) {
+        buf.reserve(PREAMBLE_MAX_BYTES);
+        append_preamble<Command>(buf.data(), buf.cnt());
+    }
+
+private:
+    template<size_t... I>
+    static constexpr std::array<BYTE, sizeof...(I)> word_bytes(unsigned word, std::index_sequence<I...>) {
+        return {{ (BYTE)(word >> (8 * I))... }};
+    }
+    template<size_t... I>
+    static constexpr PreambleBytes<PREAMBLE_MAX_BYTES> to_preamble(const ConstexprEncoder<PREAMBLE_MAX_BYTES> &encoder,
+                                                                   std::index_sequence<I...>) {
+        return {{{ encoder.data[I]... }}, encoder.cnt};
+    }
+    template<int Command, size_t... P>
+    static constexpr std::array<PreambleBytes<PREAMBLE_MAX_BYTES>, USB_PACKET_SIZE>
+    preamble_table(std::index_sequence<P...>) {
+        return {{ preamble<Command>((int) P)... }};
+    }
+};
+
+#endif // JTAG_VJTAG_INSTANCE_H
@@ -13,19 +13,57 @@ reg DR0_bypass_reg; // Safeguard in case bad IR is sent through JTAG
 reg [7:0] DR1; // Date, time and revision DR.  We could make separate Data Registers for each one, but
 reg [7:0] DR2;
 
+// DR3: memory-mapped registers. One DR scan is one transaction: 32 address bits, 1 write bit, then any number of
+// 32-bit data words (all LSB first). Every data word is written to (or read from) the address, which then increments
+// by 4, so a burst pays the header once. A read word is loaded into DR3 as soon as the header or the previous word is
+// complete and shifts out while the next word shifts in. A partial last word is dropped.
+//   0x000       ID (read only)
+//   0x004       {24'b0, data_sent_to_pc} (read only)
+//   0x100-0x1FC 64 scratch registers
+localparam DR3_ID = 32'h564A5201;
+localparam DR3_ADDR = 2'd0, DR3_WBIT = 2'd1, DR3_DATA = 2'd2;
+reg [31:0] DR3;
+reg [1:0]  DR3_phase;
+reg [4:0]  DR3_count;    // bits of the address or of the current data word shifted in
+reg        DR3_write;
+reg [31:0] DR3_addr;
+reg [31:0] DR3_regs [0:63];
+
+function [31:0] DR3_read;
+	input [31:0] addr;
+	begin
+		if (addr[31:8] == 24'h000001)
+			DR3_read = DR3_regs[addr[7:2]];
+		else if (addr[31:2] == 30'd0)
+			DR3_read = DR3_ID;
+		else if (addr[31:2] == 30'd1)
+			DR3_read = {24'b0, data_sent_to_pc};
+		else
+			DR3_read = 32'b0;
+	end
+endfunction
+
 
 // Bypass mode
-wire select_DR0 = (ir_in==0) | (ir_in==3); // Default to 0, which is the bypass register
+wire select_DR0 = (ir_in==0); // Default to 0, which is the bypass register
 // Example input mode
 wire select_DR1 = (ir_in==1); // Data Register 1 will collect the new LED settings from JTAG chain.
 // Example output mode
 wire select_DR2 = (ir_in==2); // Data Register 2 will be output to the JTAG chain for PC the read.
+// Register access mode
+wire select_DR3 = (ir_in==3); // Data Register 3 carries the register transactions.
+wire DR3_word_done = select_DR3 & ~v_cdr & v_sdr & (DR3_phase == DR3_DATA) & (DR3_count == 5'd31);
 
 always @ (posedge tck or posedge aclr) begin
 	if (aclr) begin
 		DR0_bypass_reg <= 1'b0;
 		DR1 <= 8'b00000000;
 		DR2 <= 8'b00000000;
+		DR3 <= 32'b0;
+		DR3_phase <= DR3_ADDR;
+		DR3_count <= 5'd0;
+		DR3_write <= 1'b0;
+		DR3_addr <= 32'b0;
 	end
 	else begin
 		// Update the Bypass Register always. Whether to use it in TDO or not is determined elsewhere.
@@ -46,16 +84,60 @@ always @ (posedge tck or posedge aclr) begin
 				DR2 <= {tdi, DR2[7:1]};
 			end
 		end
+
+		if(select_DR3) begin
+			if(v_cdr) begin
+				// A new transaction begins with its header
+				DR3_phase <= DR3_ADDR;
+				DR3_count <= 5'd0;
+			end
+			else if(v_sdr) begin
+				case(DR3_phase)
+				DR3_ADDR: begin
+					DR3 <= {tdi, DR3[31:1]};
+					DR3_count <= DR3_count + 5'd1;
+					if(DR3_count == 5'd31)
+						DR3_phase <= DR3_WBIT;
+				end
+				DR3_WBIT: begin
+					// DR3 holds the address. Load the first word to shift out.
+					DR3_write <= tdi;
+					DR3_addr <= DR3;
+					DR3 <= DR3_read(DR3);
+					DR3_count <= 5'd0;
+					DR3_phase <= DR3_DATA;
+				end
+				default: begin
+					DR3 <= {tdi, DR3[31:1]};
+					DR3_count <= DR3_count + 5'd1;
+					if(DR3_word_done) begin
+						// The word is complete (written below); load the next one
+						DR3_addr <= DR3_addr + 32'd4;
+						DR3 <= DR3_read(DR3_addr + 32'd4);
+					end
+				end
+				endcase
+			end
+		end
 	end
 end
 
 
+// The DR3 register writes. The scratch registers have no reset.
+always @ (posedge tck) begin
+	if (DR3_word_done && DR3_write && DR3_addr[31:8] == 24'h000001)
+		DR3_regs[DR3_addr[7:2]] <= {tdi, DR3[31:1]};
+end
+
+
 // Maintain the TDO Continuity
 always @ (*) begin
 	if (select_DR1)
 		tdo <= DR1[0];
 	else if (select_DR2)
 		tdo <= DR2[0];
+	else if (select_DR3)
+		tdo <= DR3[0];
 	else 
 		tdo <= DR0_bypass_reg;	
 end